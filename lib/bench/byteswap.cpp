@@ -0,0 +1,70 @@
+/* Compares the batched byte swap kernels with the scalar loops on columns of
+ * big endian values, the shape fixed width columns have once gathered.
+ *
+ *   make bench
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "byteswap.hpp"
+
+typedef void (*swap_fn)(void* output, const void* input, size_t count);
+
+static double now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* best of a few runs, in ns per value */
+static double measure(swap_fn fn, void* output, const void* input, size_t count) {
+  double best = 0;
+
+  for (int run = 0; run < 7; run++) {
+    double start = now_ns();
+    fn(output, input, count);
+    double elapsed = (now_ns() - start) / count;
+    if (run == 0 || elapsed < best) best = elapsed;
+  }
+
+  return best;
+}
+
+static void bench(const char* name, swap_fn vectorized, swap_fn scalar, size_t width, size_t count) {
+  uint8_t* input = (uint8_t*)malloc(width * count);
+  uint8_t* output = (uint8_t*)malloc(width * count);
+  uint8_t* expected = (uint8_t*)malloc(width * count);
+
+  for (size_t i = 0; i < width * count; i++) input[i] = (uint8_t)(i * 31 + 7);
+
+  scalar(expected, input, count);
+  vectorized(output, input, count);
+  if (memcmp(expected, output, width * count) != 0) {
+    fprintf(stderr, "%s: batched and scalar results differ\n", name);
+    exit(1);
+  }
+
+  double scalarNs = measure(scalar, output, input, count);
+  double vectorizedNs = measure(vectorized, output, input, count);
+  printf("%-8s %10zu values  scalar %6.3f ns/value  batched %6.3f ns/value  x%.1f\n", name, count, scalarNs,
+         vectorizedNs, scalarNs / vectorizedNs);
+
+  free(input);
+  free(output);
+  free(expected);
+}
+
+int main() {
+  size_t counts[] = {1000, 100000, 10000000};
+
+  for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+    bench("int2", be_to_host16, be_to_host16_scalar, 2, counts[i]);
+    bench("int4", be_to_host32, be_to_host32_scalar, 4, counts[i]);
+    bench("int8", be_to_host64, be_to_host64_scalar, 8, counts[i]);
+  }
+
+  return 0;
+}
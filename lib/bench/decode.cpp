@@ -0,0 +1,229 @@
+/* Decodes synthetic binary results, built with PQsetvalue so that no server
+ * is needed, through madpostgres__handleQueryResult and reports the time,
+ * allocations and collector heap growth per cell for a few column shapes.
+ *
+ *   make bench
+ */
+#include <arpa/inet.h>
+/* bench/gc.h, found through the include path so that it can include the
+ * collector's own header after it */
+#include <gc.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "apply-pap.hpp"
+#include "catalog/pg_type_d.h"
+#include "event-loop.hpp"
+#include "libpq-fe.h"
+#include "list.hpp"
+#include "pquv.hpp"
+
+typedef struct madpostgres__Callbacks madpostgres__Callbacks_t;
+
+extern "C" {
+
+size_t bench_allocations = 0;
+
+madpostgres__Callbacks_t* madpostgres__buildCallbacks(pquv_t* connection, PAP_t* badCB, PAP_t* goodCB);
+void madpostgres__handleQueryResult(void* callbacks, PGresult* res);
+
+/* the parts of the Madlib runtime the decoding calls, the callbacks only keep
+ * the decoded rows alive until the next run */
+static void* lastResult = NULL;
+
+void* __applyPAP__(void* pap, int32_t argc, ...) {
+  va_list args;
+  va_start(args, argc);
+  lastResult = va_arg(args, void*);
+  va_end(args);
+  return NULL;
+}
+
+double* boxDouble(double d) {
+  double* boxed = (double*)GC_MALLOC_ATOMIC(sizeof(double));
+  *boxed = d;
+  return boxed;
+}
+
+madlib__list__Node_t* madlib__list__empty() {
+  return (madlib__list__Node_t*)GC_MALLOC(sizeof(madlib__list__Node_t));
+}
+
+madlib__list__Node_t* madlib__list__push(void* item, madlib__list__Node_t* list) {
+  madlib__list__Node_t* node = (madlib__list__Node_t*)GC_MALLOC(sizeof(madlib__list__Node_t));
+  node->value = item;
+  node->next = list;
+  return node;
+}
+}
+
+uv_loop_t* getLoop() { return NULL; }
+
+/* writes the binary value of the cell at `row` of a column in `buf` and
+ * returns its length */
+typedef int (*cell_fn)(char* buf, int row);
+
+static int int2_cell(char* buf, int row) {
+  uint16_t v = htons((uint16_t)(row % 1000));
+  memcpy(buf, &v, 2);
+  return 2;
+}
+
+static int int4_cell(char* buf, int row) {
+  uint32_t v = htonl((uint32_t)row * 7);
+  memcpy(buf, &v, 4);
+  return 4;
+}
+
+static int int8_cell(char* buf, int row) {
+  uint64_t v = __builtin_bswap64((uint64_t)row * 1000003);
+  memcpy(buf, &v, 8);
+  return 8;
+}
+
+static int float8_cell(char* buf, int row) {
+  double d = row * 0.25;
+  uint64_t v;
+  memcpy(&v, &d, 8);
+  v = __builtin_bswap64(v);
+  memcpy(buf, &v, 8);
+  return 8;
+}
+
+static int bool_cell(char* buf, int row) {
+  buf[0] = row & 1;
+  return 1;
+}
+
+static int date_cell(char* buf, int row) { return int4_cell(buf, row % 20000); }
+
+static int timestamp_cell(char* buf, int row) {
+  uint64_t v = __builtin_bswap64((uint64_t)row * 1000000 + 725846400000000);
+  memcpy(buf, &v, 8);
+  return 8;
+}
+
+static int text_cell(char* buf, int row) { return sprintf(buf, "customer-%08d@example.com", row); }
+
+static int status_cell(char* buf, int row) {
+  static const char* statuses[] = {"pending", "paid", "shipped", "cancelled"};
+  return sprintf(buf, "%s", statuses[row % 4]);
+}
+
+static int jsonb_cell(char* buf, int row) {
+  buf[0] = 1;
+  return 1 + sprintf(buf + 1, "{\"id\": %d, \"name\": \"item %d\", \"tags\": [\"a\", \"b\"], \"price\": %d.5}", row,
+                     row, row % 100);
+}
+
+typedef struct {
+  const char* name;
+  int columns;
+  Oid types[8];
+  cell_fn cells[8];
+} shape_t;
+
+static const shape_t shapes[] = {
+  {"int", 3, {INT4OID, INT8OID, INT2OID}, {int4_cell, int8_cell, int2_cell}},
+  {"text", 8, {TEXTOID, TEXTOID, TEXTOID, TEXTOID, TEXTOID, TEXTOID, TEXTOID, TEXTOID},
+   {text_cell, text_cell, text_cell, text_cell, text_cell, text_cell, text_cell, text_cell}},
+  {"time", 3, {TIMESTAMPOID, TIMESTAMPTZOID, DATEOID}, {timestamp_cell, timestamp_cell, date_cell}},
+  {"json", 1, {JSONBOID}, {jsonb_cell}},
+  {"mixed", 6, {INT8OID, TEXTOID, TEXTOID, FLOAT8OID, BOOLOID, TIMESTAMPTZOID},
+   {int8_cell, text_cell, status_cell, float8_cell, bool_cell, timestamp_cell}},
+};
+
+static double now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static PGresult* build_result(const shape_t* shape, int rows) {
+  PGresult* res = PQmakeEmptyPGresult(NULL, PGRES_TUPLES_OK);
+  PGresAttDesc attrs[8];
+  char names[8][8];
+
+  for (int col = 0; col < shape->columns; col++) {
+    snprintf(names[col], sizeof(names[col]), "c%d", col);
+    attrs[col].name = names[col];
+    attrs[col].tableid = 0;
+    attrs[col].columnid = 0;
+    attrs[col].format = 1;
+    attrs[col].typid = shape->types[col];
+    attrs[col].typlen = -1;
+    attrs[col].atttypmod = -1;
+  }
+  PQsetResultAttrs(res, shape->columns, attrs);
+
+  char buf[256];
+  for (int row = 0; row < rows; row++) {
+    for (int col = 0; col < shape->columns; col++) {
+      int length = shape->cells[col](buf, row);
+      PQsetvalue(res, row, col, buf, length);
+    }
+  }
+
+  return res;
+}
+
+/* best of a few runs, each on a fresh copy of the result as decoding consumes
+ * it */
+static void bench(const shape_t* shape, size_t cells) {
+  int rows = (int)(cells / shape->columns);
+  cells = (size_t)rows * shape->columns;
+  PGresult* source = build_result(shape, rows);
+  madpostgres__Callbacks_t* callbacks = madpostgres__buildCallbacks(NULL, NULL, NULL);
+  int runs = cells >= 10000000 ? 3 : 7;
+  double best = 0;
+  size_t allocations = 0;
+  size_t bytes = 0;
+  size_t heapGrowth = 0;
+
+  for (int run = 0; run < runs; run++) {
+    PGresult* res = PQcopyResult(source, PG_COPYRES_ATTRS | PG_COPYRES_TUPLES);
+    lastResult = NULL;
+    GC_gcollect();
+
+    size_t heapBefore = GC_get_heap_size();
+    size_t bytesBefore = GC_get_total_bytes();
+    size_t allocationsBefore = bench_allocations;
+    double start = now_ns();
+    madpostgres__handleQueryResult(callbacks, res);
+    double elapsed = (now_ns() - start) / cells;
+
+    if (lastResult == NULL) {
+      fprintf(stderr, "%s: the result was not decoded\n", shape->name);
+      exit(1);
+    }
+
+    if (run == 0 || elapsed < best) best = elapsed;
+    allocations = bench_allocations - allocationsBefore;
+    bytes = GC_get_total_bytes() - bytesBefore;
+    size_t heapAfter = GC_get_heap_size();
+    heapGrowth = heapAfter > heapBefore ? heapAfter - heapBefore : 0;
+  }
+
+  printf("%-6s %9zu cells  %7.2f ns/cell  %5.2f allocs/cell  %6.1f B/cell  heap +%zu KiB\n", shape->name, cells,
+         best, (double)allocations / cells, (double)bytes / cells, heapGrowth / 1024);
+
+  lastResult = NULL;
+  PQclear(source);
+}
+
+int main() {
+  GC_INIT();
+  size_t counts[] = {1000, 100000, 1000000, 10000000};
+
+  for (size_t i = 0; i < sizeof(shapes) / sizeof(shapes[0]); i++) {
+    for (size_t j = 0; j < sizeof(counts) / sizeof(counts[0]); j++) {
+      bench(&shapes[i], counts[j]);
+    }
+  }
+
+  return 0;
+}
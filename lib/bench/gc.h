@@ -0,0 +1,25 @@
+/* Shadows the collector's header for the decode benchmark, counting every
+ * allocation made by the code it is compiled with.
+ */
+#pragma once
+
+#include_next <gc.h>
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern size_t bench_allocations;
+
+#ifdef __cplusplus
+}
+#endif
+
+#undef GC_MALLOC
+#undef GC_MALLOC_ATOMIC
+#undef GC_MALLOC_UNCOLLECTABLE
+#define GC_MALLOC(n) (bench_allocations++, GC_malloc(n))
+#define GC_MALLOC_ATOMIC(n) (bench_allocations++, GC_malloc_atomic(n))
+#define GC_MALLOC_UNCOLLECTABLE(n) (bench_allocations++, GC_malloc_uncollectable(n))
@@ -0,0 +1,471 @@
+/* Measures the event loop path of pquv, from queueing a request to its
+ * callback, against a fake server running in the same process. The server
+ * speaks enough of the v3 protocol for libpq: startup without
+ * authentication, simple and extended queries, and canned rows of int4 after
+ * a configurable delay per query. Every case keeps a fixed number of queries
+ * in flight for a second and reports queries/sec, p50/p99 latency and the
+ * CPU time of the loop thread per query.
+ *
+ *   make bench
+ */
+#include <arpa/inet.h>
+/* the collector's header, not bench/gc.h */
+#include <gc.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "histogram.hpp"
+#include "pquv.hpp"
+
+#define SSL_REQUEST_CODE 80877103
+#define GSSENC_REQUEST_CODE 80877104
+
+/* what the server answers to every query, read by the server threads once
+ * the connections of a case are open */
+static int serverLatencyUs = 0;
+static int serverRows = 1;
+
+typedef struct {
+  int fd;
+  char* in;
+  size_t inStart;
+  size_t inEnd;
+  size_t inCap;
+  char* out;
+  size_t outLen;
+  size_t outCap;
+  /* format of the result columns given by the last Bind */
+  int16_t resultFormat;
+} wire_t;
+
+static bool wire_flush(wire_t* w) {
+  size_t sent = 0;
+  while (sent < w->outLen) {
+    ssize_t n = write(w->fd, w->out + sent, w->outLen - sent);
+    if (n <= 0) return false;
+    sent += n;
+  }
+  w->outLen = 0;
+  return true;
+}
+
+/* makes `n` bytes of input available, the pending output is flushed before
+ * waiting on the socket so that pipelined queries are answered in batches */
+static bool wire_fill(wire_t* w, size_t n) {
+  while (w->inEnd - w->inStart < n) {
+    if (w->outLen > 0 && !wire_flush(w)) return false;
+
+    if (w->inStart > 0) {
+      memmove(w->in, w->in + w->inStart, w->inEnd - w->inStart);
+      w->inEnd -= w->inStart;
+      w->inStart = 0;
+    }
+    if (w->inCap - w->inEnd < n) {
+      w->inCap = w->inCap * 2 > n ? w->inCap * 2 : n;
+      w->in = (char*)realloc(w->in, w->inCap);
+    }
+
+    ssize_t r = read(w->fd, w->in + w->inEnd, w->inCap - w->inEnd);
+    if (r <= 0) return false;
+    w->inEnd += r;
+  }
+  return true;
+}
+
+static uint32_t get32(const char* p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return ntohl(v);
+}
+
+static uint16_t get16(const char* p) {
+  uint16_t v;
+  memcpy(&v, p, 2);
+  return ntohs(v);
+}
+
+static void put(wire_t* w, const void* data, size_t n) {
+  if (w->outCap - w->outLen < n) {
+    w->outCap = (w->outCap + n) * 2;
+    w->out = (char*)realloc(w->out, w->outCap);
+  }
+  memcpy(w->out + w->outLen, data, n);
+  w->outLen += n;
+}
+
+static void put32(wire_t* w, uint32_t v) {
+  v = htonl(v);
+  put(w, &v, 4);
+}
+
+static void put16(wire_t* w, uint16_t v) {
+  v = htons(v);
+  put(w, &v, 2);
+}
+
+/* starts a message, its length is patched by `end_message` */
+static size_t begin_message(wire_t* w, char type) {
+  put(w, &type, 1);
+  size_t at = w->outLen;
+  put32(w, 0);
+  return at;
+}
+
+static void end_message(wire_t* w, size_t at) {
+  uint32_t length = htonl((uint32_t)(w->outLen - at));
+  memcpy(w->out + at, &length, 4);
+}
+
+static void put_empty(wire_t* w, char type) {
+  end_message(w, begin_message(w, type));
+}
+
+static void put_parameter(wire_t* w, const char* name, const char* value) {
+  size_t at = begin_message(w, 'S');
+  put(w, name, strlen(name) + 1);
+  put(w, value, strlen(value) + 1);
+  end_message(w, at);
+}
+
+static void put_ready(wire_t* w) {
+  size_t at = begin_message(w, 'Z');
+  put(w, "I", 1);
+  end_message(w, at);
+}
+
+static void put_row_description(wire_t* w, int16_t format) {
+  size_t at = begin_message(w, 'T');
+  put16(w, 1);
+  put(w, "n", 2);
+  put32(w, 0);
+  put16(w, 0);
+  put32(w, 23); /* int4 */
+  put16(w, 4);
+  put32(w, (uint32_t)-1);
+  put16(w, format);
+  end_message(w, at);
+}
+
+static void put_rows(wire_t* w, int16_t format) {
+  if (serverLatencyUs > 0) usleep(serverLatencyUs);
+
+  for (int row = 0; row < serverRows; row++) {
+    size_t at = begin_message(w, 'D');
+    put16(w, 1);
+    if (format == 1) {
+      put32(w, 4);
+      put32(w, row);
+    } else {
+      char text[16];
+      int length = snprintf(text, sizeof(text), "%d", row);
+      put32(w, length);
+      put(w, text, length);
+    }
+    end_message(w, at);
+  }
+
+  char tag[32];
+  size_t at = begin_message(w, 'C');
+  put(w, tag, snprintf(tag, sizeof(tag), "SELECT %d", serverRows) + 1);
+  end_message(w, at);
+}
+
+/* the result format of a Bind message, the same for all the columns */
+static int16_t bind_format(const char* body, size_t length) {
+  const char* p = body;
+  p += strlen(p) + 1; /* portal */
+  p += strlen(p) + 1; /* statement */
+  int formats = get16(p);
+  p += 2 + formats * 2;
+  int params = get16(p);
+  p += 2;
+  for (int i = 0; i < params; i++) {
+    int32_t paramLength = (int32_t)get32(p);
+    p += 4 + (paramLength > 0 ? paramLength : 0);
+  }
+  int resultFormats = get16(p);
+  return resultFormats > 0 ? (int16_t)get16(p + 2) : 0;
+}
+
+static bool serve_startup(wire_t* w) {
+  for (;;) {
+    if (!wire_fill(w, 8)) return false;
+    uint32_t length = get32(w->in + w->inStart);
+    uint32_t code = get32(w->in + w->inStart + 4);
+    if (!wire_fill(w, length)) return false;
+    w->inStart += length;
+
+    if (code == SSL_REQUEST_CODE || code == GSSENC_REQUEST_CODE) {
+      put(w, "N", 1);
+      if (!wire_flush(w)) return false;
+      continue;
+    }
+    break;
+  }
+
+  size_t at = begin_message(w, 'R');
+  put32(w, 0);
+  end_message(w, at);
+  put_parameter(w, "server_version", "16.0");
+  put_parameter(w, "server_encoding", "UTF8");
+  put_parameter(w, "client_encoding", "UTF8");
+  put_parameter(w, "standard_conforming_strings", "on");
+  put_parameter(w, "integer_datetimes", "on");
+  put_parameter(w, "DateStyle", "ISO, MDY");
+  at = begin_message(w, 'K');
+  put32(w, 1);
+  put32(w, 1);
+  end_message(w, at);
+  put_ready(w);
+  return true;
+}
+
+static void* serve(void* arg) {
+  wire_t w = {};
+  w.fd = (int)(intptr_t)arg;
+  w.inCap = w.outCap = 1 << 16;
+  w.in = (char*)malloc(w.inCap);
+  w.out = (char*)malloc(w.outCap);
+
+  bool open = serve_startup(&w);
+  while (open && wire_fill(&w, 5)) {
+    char type = w.in[w.inStart];
+    uint32_t length = get32(w.in + w.inStart + 1);
+    if (!wire_fill(&w, length + 1)) break;
+    const char* body = w.in + w.inStart + 5;
+    w.inStart += length + 1;
+
+    switch (type) {
+      case 'Q':
+        put_row_description(&w, 0);
+        put_rows(&w, 0);
+        put_ready(&w);
+        break;
+      case 'P':
+        put_empty(&w, '1');
+        break;
+      case 'B':
+        w.resultFormat = bind_format(body, length - 4);
+        put_empty(&w, '2');
+        break;
+      case 'D':
+        if (body[0] == 'S') {
+          size_t at = begin_message(&w, 't');
+          put16(&w, 0);
+          end_message(&w, at);
+          put_row_description(&w, 0);
+        } else {
+          put_row_description(&w, w.resultFormat);
+        }
+        break;
+      case 'E':
+        put_rows(&w, w.resultFormat);
+        break;
+      case 'C':
+        put_empty(&w, '3');
+        break;
+      case 'S':
+        put_ready(&w);
+        break;
+      case 'H':
+        open = wire_flush(&w);
+        break;
+      case 'X':
+        open = false;
+        break;
+      default:
+        fprintf(stderr, "fake server: unexpected message %c\n", type);
+        open = false;
+        break;
+    }
+  }
+
+  close(w.fd);
+  free(w.in);
+  free(w.out);
+  return NULL;
+}
+
+static void* accept_loop(void* arg) {
+  int listener = (int)(intptr_t)arg;
+
+  for (;;) {
+    int fd = accept(listener, NULL, NULL);
+    if (fd < 0) continue;
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, serve, (void*)(intptr_t)fd);
+    pthread_detach(thread);
+  }
+
+  return NULL;
+}
+
+static int start_server() {
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+
+  if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(listener, 64) != 0) {
+    perror("fake server");
+    exit(1);
+  }
+
+  socklen_t addrLength = sizeof(addr);
+  getsockname(listener, (struct sockaddr*)&addr, &addrLength);
+
+  pthread_t thread;
+  pthread_create(&thread, NULL, accept_loop, (void*)(intptr_t)listener);
+  pthread_detach(thread);
+  return ntohs(addr.sin_port);
+}
+
+typedef struct run_st run_t;
+
+/* a query kept in flight, sent again as soon as it completes */
+typedef struct {
+  run_t* run;
+  pquv_t* pquv;
+  uint64_t sentAt;
+} slot_t;
+
+struct run_st {
+  uv_loop_t* loop;
+  uint32_t flags;
+  uint64_t deadline;
+  int connected;
+  int connections;
+  int inflight;
+  int concurrency;
+  uint64_t completed;
+  pquv_t** pquvs;
+  slot_t* slots;
+  histogram_t latency;
+};
+
+static void send_query(slot_t* slot);
+
+static void query_cb(void* opaque, PGresult* res) {
+  slot_t* slot = (slot_t*)opaque;
+  run_t* run = slot->run;
+  uint64_t now = uv_hrtime();
+
+  if (res == NULL || PQresultStatus(res) != PGRES_TUPLES_OK) {
+    fprintf(stderr, "query failed: %s\n", res != NULL ? PQresultErrorMessage(res) : "timeout");
+    exit(1);
+  }
+  PQclear(res);
+
+  histogram_record(&run->latency, (now - slot->sentAt) / 1000);
+  run->completed += 1;
+  run->inflight -= 1;
+
+  if (now < run->deadline) {
+    send_query(slot);
+  } else if (run->inflight == 0) {
+    for (int i = 0; i < run->connections; i++) pquv_free(run->pquvs[i]);
+  }
+}
+
+static void send_query(slot_t* slot) {
+  slot->sentAt = uv_hrtime();
+  slot->run->inflight += 1;
+  pquv_query_params(slot->pquv, "SELECT n FROM bench", 0, NULL, NULL, NULL, NULL, query_cb, slot, slot->run->flags);
+}
+
+static void connected_cb(void* opaque, pquv_t* pquv) {
+  run_t* run = (run_t*)opaque;
+
+  if (pquv_get_error(pquv) != PQUV_ERROR_NONE) {
+    fprintf(stderr, "connection failed: %s\n", pquv_get_errorMessage(pquv));
+    exit(1);
+  }
+
+  /* queries start once every connection is open */
+  run->connected += 1;
+  if (run->connected < run->connections) return;
+
+  run->deadline = uv_hrtime() + 1000000000;
+  for (int i = 0; i < run->concurrency; i++) send_query(&run->slots[i]);
+}
+
+static double thread_cpu_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void bench(const char* conninfo, const char* mode, uint32_t flags, int connections, int concurrency,
+                  int latencyUs, int rows) {
+  serverLatencyUs = latencyUs;
+  serverRows = rows;
+
+  run_t* run = (run_t*)calloc(1, sizeof(run_t));
+  run->loop = (uv_loop_t*)malloc(sizeof(uv_loop_t));
+  uv_loop_init(run->loop);
+  run->flags = flags;
+  run->connections = connections;
+  run->concurrency = concurrency;
+  run->pquvs = (pquv_t**)calloc(connections, sizeof(pquv_t*));
+  run->slots = (slot_t*)calloc(concurrency, sizeof(slot_t));
+
+  for (int i = 0; i < connections; i++) run->pquvs[i] = pquv_init(conninfo, run->loop, run, connected_cb);
+  for (int i = 0; i < concurrency; i++) {
+    run->slots[i].run = run;
+    run->slots[i].pquv = run->pquvs[i % connections];
+  }
+
+  double cpuStart = thread_cpu_ns();
+  uint64_t start = uv_hrtime();
+  uv_run(run->loop, UV_RUN_DEFAULT);
+  double seconds = (uv_hrtime() - start) / 1e9;
+  double cpuNs = thread_cpu_ns() - cpuStart;
+
+  printf("%-6s conns %d  in flight %4d  latency %4dus  rows %4d  %9.0f q/s  p50 %6lluus  p99 %6lluus  cpu %6.2fus/q\n",
+         mode, connections, concurrency, latencyUs, rows, run->completed / seconds,
+         (unsigned long long)histogram_percentile(&run->latency, 50),
+         (unsigned long long)histogram_percentile(&run->latency, 99), cpuNs / 1000 / run->completed);
+
+  uv_loop_close(run->loop);
+  free(run->loop);
+  free(run->pquvs);
+  free(run->slots);
+  free(run);
+}
+
+int main() {
+  GC_INIT();
+
+  char conninfo[128];
+  snprintf(conninfo, sizeof(conninfo), "host=127.0.0.1 port=%d user=bench dbname=bench sslmode=disable",
+           start_server());
+
+  int concurrencies[] = {1, 16, 256};
+
+  for (size_t i = 0; i < sizeof(concurrencies) / sizeof(concurrencies[0]); i++) {
+    bench(conninfo, "plain", PQUV_NON_VOLATILE_QUERY_STRING, 1, concurrencies[i], 0, 1);
+    bench(conninfo, "cached", PQUV_NON_VOLATILE_QUERY_STRING | PQUV_CACHE_STATEMENT, 1, concurrencies[i], 0, 1);
+  }
+
+  bench(conninfo, "cached", PQUV_NON_VOLATILE_QUERY_STRING | PQUV_CACHE_STATEMENT, 4, 256, 0, 1);
+  bench(conninfo, "cached", PQUV_NON_VOLATILE_QUERY_STRING | PQUV_CACHE_STATEMENT, 1, 16, 0, 100);
+
+  for (size_t i = 0; i < sizeof(concurrencies) / sizeof(concurrencies[0]); i++) {
+    bench(conninfo, "cached", PQUV_NON_VOLATILE_QUERY_STRING | PQUV_CACHE_STATEMENT, 1, concurrencies[i], 200, 1);
+  }
+
+  return 0;
+}
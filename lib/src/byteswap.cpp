@@ -0,0 +1,172 @@
+#include "byteswap.hpp"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BYTESWAP_X86
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define BYTESWAP_NEON
+#endif
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define BYTESWAP_HOST_IS_BE
+#endif
+
+void be_to_host16_scalar(void* output, const void* input, size_t count) {
+  const uint8_t* in = (const uint8_t*)input;
+  uint8_t* out = (uint8_t*)output;
+
+  for (size_t i = 0; i < count; i++) {
+    uint16_t v;
+    memcpy(&v, in + i * 2, 2);
+    v = __builtin_bswap16(v);
+    memcpy(out + i * 2, &v, 2);
+  }
+}
+
+void be_to_host32_scalar(void* output, const void* input, size_t count) {
+  const uint8_t* in = (const uint8_t*)input;
+  uint8_t* out = (uint8_t*)output;
+
+  for (size_t i = 0; i < count; i++) {
+    uint32_t v;
+    memcpy(&v, in + i * 4, 4);
+    v = __builtin_bswap32(v);
+    memcpy(out + i * 4, &v, 4);
+  }
+}
+
+void be_to_host64_scalar(void* output, const void* input, size_t count) {
+  const uint8_t* in = (const uint8_t*)input;
+  uint8_t* out = (uint8_t*)output;
+
+  for (size_t i = 0; i < count; i++) {
+    uint64_t v;
+    memcpy(&v, in + i * 8, 8);
+    v = __builtin_bswap64(v);
+    memcpy(out + i * 8, &v, 8);
+  }
+}
+
+#ifdef BYTESWAP_X86
+
+/* shuffle masks reversing the bytes of each 2, 4 or 8 bytes value, the same
+ * pattern is repeated in both 128 bits lanes for AVX2 */
+static const uint8_t mask16[32] = {1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+                                   1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14};
+static const uint8_t mask32[32] = {3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                   3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12};
+static const uint8_t mask64[32] = {7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+                                   7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8};
+
+/* kernels swap whole vectors and return the number of bytes done, the tail
+ * is left to the scalar versions */
+typedef size_t (*swap_kernel_t)(uint8_t* out, const uint8_t* in, size_t bytes, const uint8_t* mask);
+
+__attribute__((target("avx2"))) static size_t swap_avx2(uint8_t* out, const uint8_t* in, size_t bytes,
+                                                        const uint8_t* mask) {
+  __m256i m = _mm256_loadu_si256((const __m256i*)mask);
+  size_t i = 0;
+
+  for (; i + 64 <= bytes; i += 64) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)(in + i));
+    __m256i b = _mm256_loadu_si256((const __m256i*)(in + i + 32));
+    _mm256_storeu_si256((__m256i*)(out + i), _mm256_shuffle_epi8(a, m));
+    _mm256_storeu_si256((__m256i*)(out + i + 32), _mm256_shuffle_epi8(b, m));
+  }
+
+  for (; i + 32 <= bytes; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)(in + i));
+    _mm256_storeu_si256((__m256i*)(out + i), _mm256_shuffle_epi8(a, m));
+  }
+
+  return i;
+}
+
+__attribute__((target("ssse3"))) static size_t swap_ssse3(uint8_t* out, const uint8_t* in, size_t bytes,
+                                                          const uint8_t* mask) {
+  __m128i m = _mm_loadu_si128((const __m128i*)mask);
+  size_t i = 0;
+
+  for (; i + 16 <= bytes; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i*)(in + i));
+    _mm_storeu_si128((__m128i*)(out + i), _mm_shuffle_epi8(a, m));
+  }
+
+  return i;
+}
+
+static swap_kernel_t pick_kernel() {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return swap_avx2;
+  if (__builtin_cpu_supports("ssse3")) return swap_ssse3;
+  return NULL;
+}
+
+static size_t swap_vectors(uint8_t* out, const uint8_t* in, size_t bytes, size_t width) {
+  static swap_kernel_t kernel = pick_kernel();
+  if (kernel == NULL) return 0;
+
+  const uint8_t* mask = width == 2 ? mask16 : width == 4 ? mask32 : mask64;
+  return kernel(out, in, bytes, mask);
+}
+
+#elif defined(BYTESWAP_NEON)
+
+static size_t swap_vectors(uint8_t* out, const uint8_t* in, size_t bytes, size_t width) {
+  size_t i = 0;
+
+  for (; i + 16 <= bytes; i += 16) {
+    uint8x16_t a = vld1q_u8(in + i);
+    switch (width) {
+      case 2:
+        a = vrev16q_u8(a);
+        break;
+      case 4:
+        a = vrev32q_u8(a);
+        break;
+      default:
+        a = vrev64q_u8(a);
+        break;
+    }
+    vst1q_u8(out + i, a);
+  }
+
+  return i;
+}
+
+#else
+
+static size_t swap_vectors(uint8_t* out, const uint8_t* in, size_t bytes, size_t width) { return 0; }
+
+#endif
+
+void be_to_host16(void* output, const void* input, size_t count) {
+#ifdef BYTESWAP_HOST_IS_BE
+  memmove(output, input, count * 2);
+#else
+  size_t done = swap_vectors((uint8_t*)output, (const uint8_t*)input, count * 2, 2);
+  be_to_host16_scalar((uint8_t*)output + done, (const uint8_t*)input + done, count - done / 2);
+#endif
+}
+
+void be_to_host32(void* output, const void* input, size_t count) {
+#ifdef BYTESWAP_HOST_IS_BE
+  memmove(output, input, count * 4);
+#else
+  size_t done = swap_vectors((uint8_t*)output, (const uint8_t*)input, count * 4, 4);
+  be_to_host32_scalar((uint8_t*)output + done, (const uint8_t*)input + done, count - done / 4);
+#endif
+}
+
+void be_to_host64(void* output, const void* input, size_t count) {
+#ifdef BYTESWAP_HOST_IS_BE
+  memmove(output, input, count * 8);
+#else
+  size_t done = swap_vectors((uint8_t*)output, (const uint8_t*)input, count * 8, 8);
+  be_to_host64_scalar((uint8_t*)output + done, (const uint8_t*)input + done, count - done / 8);
+#endif
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Converts `count` packed big endian values of 2, 4 or 8 bytes from `input`
+ * to host order in `output`, `input` and `output` may be the same buffer.
+ * Batches are swapped with AVX2 or SSSE3 shuffles when the CPU supports them,
+ * with NEON on ARM, and one value at a time otherwise.
+ */
+void be_to_host16(void* output, const void* input, size_t count);
+void be_to_host32(void* output, const void* input, size_t count);
+void be_to_host64(void* output, const void* input, size_t count);
+
+/* the one value at a time versions, for benchmarks */
+void be_to_host16_scalar(void* output, const void* input, size_t count);
+void be_to_host32_scalar(void* output, const void* input, size_t count);
+void be_to_host64_scalar(void* output, const void* input, size_t count);
+
+#ifdef __cplusplus
+}
+#endif
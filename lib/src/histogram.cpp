@@ -0,0 +1,58 @@
+#include "histogram.hpp"
+
+#include <math.h>
+#include <stdint.h>
+
+#define SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+
+static int bucket_index(uint64_t value) {
+  if (value < SUB_BUCKETS) return (int)value;
+
+  int exponent = 63 - __builtin_clzll(value);
+  if (exponent >= HISTOGRAM_MAX_BITS) return HISTOGRAM_BUCKETS - 1;
+
+  int shift = exponent - HISTOGRAM_SUB_BITS;
+  return ((shift + 1) << HISTOGRAM_SUB_BITS) | (int)((value >> shift) & (SUB_BUCKETS - 1));
+}
+
+uint64_t histogram_bucket_limit(int i) {
+  if (i < SUB_BUCKETS) return (uint64_t)i;
+
+  int shift = (i >> HISTOGRAM_SUB_BITS) - 1;
+  uint64_t lower = (uint64_t)(SUB_BUCKETS | (i & (SUB_BUCKETS - 1))) << shift;
+  return lower + ((uint64_t)1 << shift) - 1;
+}
+
+void histogram_record(histogram_t* h, uint64_t value) {
+  h->buckets[bucket_index(value)] += 1;
+  h->count += 1;
+  h->sum += value;
+  if (value > h->max) h->max = value;
+}
+
+void histogram_merge(histogram_t* into, const histogram_t* h) {
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) into->buckets[i] += h->buckets[i];
+  into->count += h->count;
+  into->sum += h->sum;
+  if (h->max > into->max) into->max = h->max;
+}
+
+uint64_t histogram_percentile(const histogram_t* h, double p) {
+  if (h->count == 0) return 0;
+  if (p >= 100) return h->max;
+
+  uint64_t rank = (uint64_t)ceil(p / 100 * h->count);
+  if (rank == 0) rank = 1;
+
+  uint64_t seen = 0;
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen >= rank) {
+      /* the last bucket is open ended */
+      uint64_t limit = i == HISTOGRAM_BUCKETS - 1 ? h->max : histogram_bucket_limit(i);
+      return limit < h->max ? limit : h->max;
+    }
+  }
+
+  return h->max;
+}
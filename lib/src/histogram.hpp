@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Log-linear histogram of durations, in the manner of HDR histograms: values
+ * below 8 get a bucket each, above that every power of two is split into 8
+ * buckets, so a value is reported at most 12.5% above what it was. Recording
+ * is a few integer instructions and no allocation. Values of 2^36 and more
+ * share the last bucket.
+ */
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_MAX_BITS 36
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+typedef struct {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  uint64_t buckets[HISTOGRAM_BUCKETS];
+} histogram_t;
+
+void histogram_record(histogram_t* h, uint64_t value);
+void histogram_merge(histogram_t* into, const histogram_t* h);
+
+/* upper bound of the values up to the percentile `p`, from 0 to 100, the
+ * largest value recorded for 100 and 0 for an empty histogram */
+uint64_t histogram_percentile(const histogram_t* h, double p);
+
+/* largest value counted in the bucket `i` */
+uint64_t histogram_bucket_limit(int i);
+
+#ifdef __cplusplus
+}
+#endif
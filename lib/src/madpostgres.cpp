@@ -5,46 +5,81 @@
 #include "list.hpp"
 #include "date.hpp"
 #include "number.hpp"
+#include "bytearray.hpp"
+#include "byteswap.hpp"
 #include "catalog/pg_type_d.h"
 #include "madpostgres.hpp"
 
+#include <limits.h>
+
 
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-union int2Value {
-  char bytes[2];
-  int16_t num;
-};
+typedef struct madpostgres__Callbacks {
+  void *badCB;
+  void *goodCB;
+  pquv_t *connection;
+  // the pool being opened by madpostgres__connectPool
+  pquv_pool_t *pool;
+  // set by madpostgres__cancel while the result is decoded off the loop
+  bool cancelled;
+  // set once a connection attempt succeeded, failed or was cancelled
+  bool settled;
+} madpostgres__Callbacks_t;
 
-union int4Value {
-  char bytes[4];
-  int32_t num;
-};
 
-union int8Value {
-  char bytes[8];
-  int64_t num;
-};
+// rows still to be sent by a COPY FROM STDIN, encoded chunk by chunk into
+// buffer
+typedef struct madpostgres__CopyInCallbacks {
+  void *badCB;
+  void *goodCB;
+  pquv_t *connection;
+  madlib__list__Node_t *rows;
+  char *buffer;
+  size_t capacity;
+  bool headerSent;
+  bool trailerSent;
+} madpostgres__CopyInCallbacks_t;
 
-union float4Value {
-  char bytes[4];
-  double num;
-};
 
-union float8Value {
-  char bytes[8];
-  double num;
-};
+// COPY data is buffered until a chunk can be handed to sinkCB
+typedef struct madpostgres__CopyOutCallbacks {
+  void *badCB;
+  void *goodCB;
+  void *sinkCB;
+  pquv_t *connection;
+  unsigned char *buffer;
+  size_t capacity;
+  size_t length;
+} madpostgres__CopyOutCallbacks_t;
 
 
-typedef struct madpostgres__Callbacks {
+// rows are buffered until chunkSize of them can be handed to chunkCB
+typedef struct madpostgres__StreamCallbacks {
   void *badCB;
   void *goodCB;
+  void *chunkCB;
   pquv_t *connection;
-} madpostgres__Callbacks_t;
+  madpostgres__DecodePlan_t *plan;
+  int64_t chunkSize;
+  void **rows;
+  int64_t bufferedCount;
+  int64_t deliveredCount;
+  bool stopped;
+} madpostgres__StreamCallbacks_t;
+
+
+// results of the statements decoded so far, the last one first
+typedef struct madpostgres__MultiCallbacks {
+  void *badCB;
+  void *goodCB;
+  pquv_t *connection;
+  madlib__list__Node_t *results;
+  bool failed;
+} madpostgres__MultiCallbacks_t;
 
 
 void madpostgres__handleConnection(void *callbacks, pquv_t* connection) {
@@ -52,6 +87,11 @@ void madpostgres__handleConnection(void *callbacks, pquv_t* connection) {
   int err = pquv_get_error(connection);
   char *errMessage = pquv_get_errorMessage(connection);
 
+  if (typedCallbacks->settled) {
+    return;
+  }
+  typedCallbacks->settled = true;
+
   if (err > 0) {
     pquv_free(connection);
     __applyPAP__(typedCallbacks->badCB, 2, err, errMessage);
@@ -61,12 +101,27 @@ void madpostgres__handleConnection(void *callbacks, pquv_t* connection) {
 }
 
 
-void madpostgres__connect(char *connectionString, PAP_t *badCB, PAP_t *goodCB) {
+void *madpostgres__connect(char *connectionString, PAP_t *badCB, PAP_t *goodCB) {
   madpostgres__Callbacks_t *callbacks = (madpostgres__Callbacks_t*) GC_MALLOC(sizeof(madpostgres__Callbacks_t));
   callbacks->badCB = badCB;
   callbacks->goodCB = goodCB;
   callbacks->connection = NULL;
-  pquv_init(connectionString, getLoop(), callbacks, madpostgres__handleConnection);
+  callbacks->settled = false;
+  callbacks->cancelled = false;
+  callbacks->connection = pquv_init(connectionString, getLoop(), callbacks, madpostgres__handleConnection);
+  return callbacks;
+}
+
+
+// closes a connection that is still being established, neither callback is
+// called then
+void madpostgres__cancelConnect(void *request) {
+  madpostgres__Callbacks_t *callbacks = (madpostgres__Callbacks_t*)request;
+
+  if (!callbacks->settled) {
+    callbacks->settled = true;
+    pquv_free(callbacks->connection);
+  }
 }
 
 
@@ -75,336 +130,2739 @@ void madpostgres__disconnect(pquv_t *connection) {
 }
 
 
-int64_t ntoh64(int64_t *input) {
-  uint64_t rval;
-  uint8_t *data = (uint8_t *)&rval;
+// cells are carved out of the arenas of the decode context, see
+// madpostgres__initDecodeContext
+madpostgres__Value_t *madpostgres__allocValue(madpostgres__DecodeContext_t *ctx) {
+  return &ctx->values[ctx->valueOffset++];
+}
 
-  data[0] = *input >> 56;
-  data[1] = *input >> 48;
-  data[2] = *input >> 40;
-  data[3] = *input >> 32;
-  data[4] = *input >> 24;
-  data[5] = *input >> 16;
-  data[6] = *input >> 8;
-  data[7] = *input >> 0;
 
-  return rval;
+madpostgres__MadlibADT_t *madpostgres__allocDateTime(madpostgres__DecodeContext_t *ctx) {
+  return &ctx->dateTimes[ctx->dateTimeOffset++];
 }
 
-double ntoh_float8(char *input) {
-  double rval;
-  uint8_t *data = (uint8_t *)&rval;
 
-  data[0] = input[7];
-  data[1] = input[6];
-  data[2] = input[5];
-  data[3] = input[4];
-  data[4] = input[3];
-  data[5] = input[2];
-  data[6] = input[1];
-  data[7] = input[0];
+madlib__bytearray__ByteArray_t *madpostgres__allocByteArray(madpostgres__DecodeContext_t *ctx) {
+  return &ctx->byteArrays[ctx->byteArrayOffset++];
+}
+
 
-  return rval;
+double *madpostgres__boxDouble(madpostgres__DecodeContext_t *ctx, double value) {
+  double *boxed = &ctx->floats[ctx->floatOffset++];
+  *boxed = value;
+  return boxed;
 }
 
-double ntoh_float4(char *input) {
-  float rval;
-  uint8_t *data = (uint8_t *)&rval;
 
-  data[0] = input[3];
-  data[1] = input[2];
-  data[2] = input[1];
-  data[3] = input[0];
+// Values are immutable once handed to Madlib, so the common ones are shared
+// by all results instead of being decoded again for each cell
+madpostgres__Value_t madpostgres__trueValue = { madpostgres__Value_Boolean, (void*)1, NULL };
+madpostgres__Value_t madpostgres__falseValue = { madpostgres__Value_Boolean, (void*)0, NULL };
+madpostgres__Value_t madpostgres__notImplementedValue = { madpostgres__Value_NotImplemented, NULL, NULL };
+
+// Int2, Int4 and Int8 Values in [MADPOSTGRES_SMALL_INT_MIN, MADPOSTGRES_SMALL_INT_MAX[
+madpostgres__Value_t madpostgres__smallInts[3][MADPOSTGRES_SMALL_INT_MAX - MADPOSTGRES_SMALL_INT_MIN];
+bool madpostgres__smallIntsReady = false;
+
+
+void madpostgres__initSmallInts() {
+  const int64_t indices[3] = { madpostgres__Value_Int2, madpostgres__Value_Int4, madpostgres__Value_Int8 };
+
+  for (int i = 0; i < 3; i++) {
+    for (int64_t n = MADPOSTGRES_SMALL_INT_MIN; n < MADPOSTGRES_SMALL_INT_MAX; n++) {
+      madpostgres__smallInts[i][n - MADPOSTGRES_SMALL_INT_MIN].index = indices[i];
+      madpostgres__smallInts[i][n - MADPOSTGRES_SMALL_INT_MIN].data1 = (void*)n;
+    }
+  }
 
-  return (double) rval;
+  madpostgres__smallIntsReady = true;
 }
 
 
-madpostgres__Value_t *madpostgres__buildInt8Value(char *pqValue) {
-  union int8Value num;
-  memcpy(num.bytes, pqValue, 8);
-  int64_t hostOrdered = ntoh64(&num.num);
+madpostgres__Value_t *madpostgres__buildIntegerValue(int64_t index, int64_t n, madpostgres__DecodeContext_t *ctx) {
+  if (n >= MADPOSTGRES_SMALL_INT_MIN && n < MADPOSTGRES_SMALL_INT_MAX) {
+    return &madpostgres__smallInts[index - madpostgres__Value_Int2][n - MADPOSTGRES_SMALL_INT_MIN];
+  }
 
-  madpostgres__Value_t *res = (madpostgres__Value_t*) GC_MALLOC(sizeof(madpostgres__Value_t));
-  res->index = madpostgres__Value_Int8;
-  res->data1 = (void*)hostOrdered;
+  madpostgres__Value_t *res = madpostgres__allocValue(ctx);
+  res->index = index;
+  res->data1 = (void*)n;
   return res;
 }
 
 
-madpostgres__Value_t *madpostgres__buildInt4Value(char *pqValue) {
-  union int4Value num;
-  memcpy(num.bytes, pqValue, 4);
-  int64_t hostOrdered = ntohl(num.num);
+// returns count nodes linked to each other, followed by the empty list
+madlib__list__Node_t *madpostgres__allocList(madpostgres__DecodeContext_t *ctx, int count) {
+  madlib__list__Node_t *nodes = &ctx->nodes[ctx->nodeOffset];
+  ctx->nodeOffset += count + 1;
 
-  madpostgres__Value_t *res = (madpostgres__Value_t*) GC_MALLOC(sizeof(madpostgres__Value_t));
-  res->index = madpostgres__Value_Int4;
-  res->data1 = (void*)hostOrdered;
-  return res;
+  for (int i = 0; i < count; i++) {
+    nodes[i].next = &nodes[i + 1];
+  }
+  nodes[count].value = NULL;
+  nodes[count].next = NULL;
+
+  return nodes;
+}
+
+
+// fixed width cells are read from the columns decoded by
+// madpostgres__decodeFixedColumn, pqValue is unused
+madpostgres__Cell_t madpostgres__currentCell(madpostgres__DecodeContext_t *ctx) {
+  return ctx->cells[ctx->col][ctx->row];
 }
 
 
-madpostgres__Value_t *madpostgres__buildInt2Value(char *pqValue) {
-  union int2Value num;
-  memcpy(num.bytes, pqValue, 2);
-  int64_t hostOrdered = ntohs(num.num);
+madpostgres__Value_t *madpostgres__buildInt8Value(char *pqValue, int length, madpostgres__DecodeContext_t *ctx) {
+  return madpostgres__buildIntegerValue(madpostgres__Value_Int8, madpostgres__currentCell(ctx).i, ctx);
+}
 
-  madpostgres__Value_t *res = (madpostgres__Value_t*) GC_MALLOC(sizeof(madpostgres__Value_t));
-  res->index = madpostgres__Value_Int2;
-  res->data1 = (void*)hostOrdered;
-  return res;
+
+madpostgres__Value_t *madpostgres__buildInt4Value(char *pqValue, int length, madpostgres__DecodeContext_t *ctx) {
+  return madpostgres__buildIntegerValue(madpostgres__Value_Int4, madpostgres__currentCell(ctx).i, ctx);
 }
 
 
-madpostgres__Value_t *madpostgres__buildMoneyValue(char *pqValue) {
-  union int8Value num;
-  memcpy(num.bytes, pqValue, 8);
-  int64_t hostOrdered = ntoh64(&num.num);
+madpostgres__Value_t *madpostgres__buildInt2Value(char *pqValue, int length, madpostgres__DecodeContext_t *ctx) {
+  return madpostgres__buildIntegerValue(madpostgres__Value_Int2, madpostgres__currentCell(ctx).i, ctx);
+}
 
-  madpostgres__Value_t *res = (madpostgres__Value_t*) GC_MALLOC(sizeof(madpostgres__Value_t));
+
+madpostgres__Value_t *madpostgres__buildMoney(int64_t cents, madpostgres__DecodeContext_t *ctx) {
+  madpostgres__Value_t *res = madpostgres__allocValue(ctx);
   res->index = madpostgres__Value_Money;
-  res->data1 = (void*) (hostOrdered / 100);
-  res->data2 = (void*) (hostOrdered - ((hostOrdered / 100) * 100));
-  return (madpostgres__Value_t*)res;
+  res->data1 = (void*) (cents / 100);
+  res->data2 = (void*) (cents - ((cents / 100) * 100));
+  return res;
 }
 
 
-madpostgres__Value_t *madpostgres__buildTimestampValue(char *pqValue) {
-  union int8Value num;
-  memcpy(num.bytes, pqValue, 8);
-  int64_t hostOrdered = (ntoh64(&num.num) + 946684800000000) / 1000;
-  madpostgres__MadlibADT_t *dateTime = (madpostgres__MadlibADT_t*) GC_MALLOC(sizeof(madpostgres__MadlibADT_t));
+madpostgres__Value_t *madpostgres__buildDateTime(int64_t index, int64_t ms, madpostgres__DecodeContext_t *ctx) {
+  madpostgres__MadlibADT_t *dateTime = madpostgres__allocDateTime(ctx);
   dateTime->index = 0;
-  dateTime->data = (void*)hostOrdered;
+  dateTime->data = (void*)ms;
 
-  madpostgres__Value_t *res = (madpostgres__Value_t*) GC_MALLOC(sizeof(madpostgres__Value_t));
-  res->index = madpostgres__Value_Timestamp;
+  madpostgres__Value_t *res = madpostgres__allocValue(ctx);
+  res->index = index;
   res->data1 = (void*)dateTime;
   return res;
 }
 
 
-madpostgres__Value_t *madpostgres__buildTimestampTzValue(char *pqValue) {
-  madpostgres__Value_t *res = madpostgres__buildTimestampValue(pqValue);
-  res->index = madpostgres__Value_TimestampTz;
+madpostgres__Value_t *madpostgres__buildFloat(int64_t index, double f, madpostgres__DecodeContext_t *ctx) {
+  madpostgres__Value_t *res = madpostgres__allocValue(ctx);
+  res->index = index;
+  res->data1 = (void*)madpostgres__boxDouble(ctx, f);
   return res;
 }
 
 
-madpostgres__Value_t *madpostgres__buildDateValue(char *pqValue) {
-  union int4Value num;
-  memcpy(num.bytes, pqValue, 4);
+madpostgres__Value_t *madpostgres__buildMoneyValue(char *pqValue, int length, madpostgres__DecodeContext_t *ctx) {
+  return madpostgres__buildMoney(madpostgres__currentCell(ctx).i, ctx);
+}
 
-  int64_t hostOrdered = (int64_t) ntohl(num.num) * 24 * 60 * 60 * 1000 + 946684800000;
 
-  madpostgres__MadlibADT_t *dateTime = (madpostgres__MadlibADT_t*) GC_MALLOC(sizeof(madpostgres__MadlibADT_t));
-  dateTime->index = 0;
-  dateTime->data = (void*)hostOrdered;
+madpostgres__Value_t *madpostgres__buildTimestampValue(char *pqValue, int length, madpostgres__DecodeContext_t *ctx) {
+  return madpostgres__buildDateTime(madpostgres__Value_Timestamp, madpostgres__currentCell(ctx).i, ctx);
+}
 
-  madpostgres__Value_t *res = (madpostgres__Value_t*) GC_MALLOC(sizeof(madpostgres__Value_t));
-  res->index = madpostgres__Value_Date;
-  res->data1 = (void*)dateTime;
-  return res;
+
+madpostgres__Value_t *madpostgres__buildTimestampTzValue(char *pqValue, int length, madpostgres__DecodeContext_t *ctx) {
+  return madpostgres__buildDateTime(madpostgres__Value_TimestampTz, madpostgres__currentCell(ctx).i, ctx);
 }
 
 
-madpostgres__Value_t *madpostgres__buildFloat8Value(char *pqValue) {
-  union float8Value num;
-  memcpy(num.bytes, pqValue, 8);
+madpostgres__Value_t *madpostgres__buildDateValue(char *pqValue, int length, madpostgres__DecodeContext_t *ctx) {
+  return madpostgres__buildDateTime(madpostgres__Value_Date, madpostgres__currentCell(ctx).i, ctx);
+}
 
-  madpostgres__Value_t *res = (madpostgres__Value_t*) GC_MALLOC(sizeof(madpostgres__Value_t));
-  res->index = madpostgres__Value_Float8;
-  res->data1 = (void*)boxDouble(ntoh_float8((char*)&num.num));
-  return res;
+
+madpostgres__Value_t *madpostgres__buildFloat8Value(char *pqValue, int length, madpostgres__DecodeContext_t *ctx) {
+  return madpostgres__buildFloat(madpostgres__Value_Float8, madpostgres__currentCell(ctx).f, ctx);
 }
 
 
-madpostgres__Value_t *madpostgres__buildFloat4Value(char *pqValue) {
-  union float4Value num;
-  memcpy(num.bytes, pqValue, 4);
+madpostgres__Value_t *madpostgres__buildFloat4Value(char *pqValue, int length, madpostgres__DecodeContext_t *ctx) {
+  return madpostgres__buildFloat(madpostgres__Value_Float4, madpostgres__currentCell(ctx).f, ctx);
+}
 
-  madpostgres__Value_t *res = (madpostgres__Value_t*) GC_MALLOC(sizeof(madpostgres__Value_t));
-  res->index = madpostgres__Value_Float4;
-  res->data1 = (void*)boxDouble(ntoh_float4((char*)&num.num));
-  return res;
+
+// same as the fixed width parsers, for a cell decoded elsewhere
+madpostgres__Value_t *madpostgres__buildFixedValue(Oid type, madpostgres__Cell_t cell, madpostgres__DecodeContext_t *ctx) {
+  switch (type) {
+    case INT8OID:
+      return madpostgres__buildIntegerValue(madpostgres__Value_Int8, cell.i, ctx);
+
+    case INT4OID:
+      return madpostgres__buildIntegerValue(madpostgres__Value_Int4, cell.i, ctx);
+
+    case INT2OID:
+      return madpostgres__buildIntegerValue(madpostgres__Value_Int2, cell.i, ctx);
+
+    case MONEYOID:
+      return madpostgres__buildMoney(cell.i, ctx);
+
+    case TIMESTAMPOID:
+      return madpostgres__buildDateTime(madpostgres__Value_Timestamp, cell.i, ctx);
+
+    case TIMESTAMPTZOID:
+      return madpostgres__buildDateTime(madpostgres__Value_TimestampTz, cell.i, ctx);
+
+    case DATEOID:
+      return madpostgres__buildDateTime(madpostgres__Value_Date, cell.i, ctx);
+
+    case FLOAT8OID:
+      return madpostgres__buildFloat(madpostgres__Value_Float8, cell.f, ctx);
+
+    case FLOAT4OID:
+      return madpostgres__buildFloat(madpostgres__Value_Float4, cell.f, ctx);
+
+    default:
+      return &madpostgres__notImplementedValue;
+  }
 }
 
 
-madpostgres__Value_t *madpostgres__buildBooleanValue(char *pqValue) {
-  madpostgres__Value_t *res = (madpostgres__Value_t*) GC_MALLOC(sizeof(madpostgres__Value_t));
-  res->index = madpostgres__Value_Boolean;
-  res->data1 = (void*) (*pqValue > 0 ? 1 : 0);
-  return res;
+madpostgres__Value_t *madpostgres__buildBooleanValue(char *pqValue, int length, madpostgres__DecodeContext_t *ctx) {
+  return *pqValue > 0 ? &madpostgres__trueValue : &madpostgres__falseValue;
+}
+
+
+uint32_t madpostgres__hashBytes(const char *bytes, int length) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < length; i++) {
+    hash = (hash ^ (uint8_t)bytes[i]) * 16777619u;
+  }
+  return hash;
+}
+
+
+// Short strings of a column are interned so that repeated ones share their
+// Value. A column gives up on interning for the rest of the result once it
+// has more distinct values than the table can hold.
+madpostgres__Value_t *madpostgres__internedValue(
+  madpostgres__InternTable_t *table,
+  uint32_t hash,
+  char *pqValue,
+  int length
+) {
+  uint32_t slot = hash % MADPOSTGRES_INTERN_SLOTS;
+
+  while (table->values[slot] != NULL) {
+    if (table->hashes[slot] == hash
+        && table->lengths[slot] == length
+        && memcmp(table->values[slot]->data1, pqValue, length) == 0) {
+      return table->values[slot];
+    }
+    slot = (slot + 1) % MADPOSTGRES_INTERN_SLOTS;
+  }
+
+  return NULL;
 }
 
 
-madpostgres__Value_t *madpostgres__buildTextValue(char *pqValue) {
-  size_t length = strlen(pqValue);
-  char *copy = (char*)GC_MALLOC_ATOMIC(length + 1);
+void madpostgres__internValue(madpostgres__InternTable_t *table, uint32_t hash, int length, madpostgres__Value_t *value) {
+  if (table->count == MADPOSTGRES_INTERN_CAPACITY) {
+    table->disabled = true;
+    return;
+  }
+
+  uint32_t slot = hash % MADPOSTGRES_INTERN_SLOTS;
+  while (table->values[slot] != NULL) {
+    slot = (slot + 1) % MADPOSTGRES_INTERN_SLOTS;
+  }
+
+  table->hashes[slot] = hash;
+  table->lengths[slot] = length;
+  table->values[slot] = value;
+  table->count += 1;
+}
+
+
+madpostgres__Value_t *madpostgres__buildStringValue(
+  int64_t index,
+  char *pqValue,
+  int length,
+  madpostgres__DecodeContext_t *ctx
+) {
+  madpostgres__InternTable_t *table = NULL;
+  uint32_t hash = 0;
+
+  if (ctx->interns != NULL && length <= MADPOSTGRES_INTERN_MAX_LENGTH) {
+    table = ctx->interns[ctx->col];
+    if (table == NULL) {
+      table = (madpostgres__InternTable_t*)GC_MALLOC(sizeof(madpostgres__InternTable_t));
+      ctx->interns[ctx->col] = table;
+    }
+
+    if (table->disabled) {
+      table = NULL;
+    } else {
+      hash = madpostgres__hashBytes(pqValue, length);
+      madpostgres__Value_t *interned = madpostgres__internedValue(table, hash, pqValue, length);
+      if (interned != NULL) {
+        return interned;
+      }
+    }
+  }
+
+  char *copy = ctx->slab + ctx->slabOffset;
   memcpy(copy, pqValue, length);
   copy[length] = '\0';
+  ctx->slabOffset += length + 1;
 
-  madpostgres__Value_t *res = (madpostgres__Value_t*) GC_MALLOC(sizeof(madpostgres__Value_t));
-  res->index = madpostgres__Value_Text;
+  madpostgres__Value_t *res = madpostgres__allocValue(ctx);
+  res->index = index;
   res->data1 = (void*)copy;
+
+  if (table != NULL) {
+    madpostgres__internValue(table, hash, length, res);
+  }
+
   return res;
 }
 
 
-madpostgres__Value_t *madpostgres__buildVarCharValue(char *pqValue) {
-  madpostgres__Value_t *res = madpostgres__buildTextValue(pqValue);
-  res->index = madpostgres__Value_VarChar;
+madpostgres__Value_t *madpostgres__buildTextValue(char *pqValue, int length, madpostgres__DecodeContext_t *ctx) {
+  return madpostgres__buildStringValue(madpostgres__Value_Text, pqValue, length, ctx);
+}
+
+
+madpostgres__Value_t *madpostgres__buildVarCharValue(char *pqValue, int length, madpostgres__DecodeContext_t *ctx) {
+  return madpostgres__buildStringValue(madpostgres__Value_VarChar, pqValue, length, ctx);
+}
+
+
+madpostgres__Value_t *madpostgres__buildJsonValue(char *pqValue, int length, madpostgres__DecodeContext_t *ctx) {
+  return madpostgres__buildStringValue(madpostgres__Value_Json, pqValue, length, ctx);
+}
+
+
+// binary jsonb starts with a version byte
+madpostgres__Value_t *madpostgres__buildJsonBValue(char *pqValue, int length, madpostgres__DecodeContext_t *ctx) {
+  return length > 0
+    ? madpostgres__buildStringValue(madpostgres__Value_JsonB, pqValue + 1, length - 1, ctx)
+    : madpostgres__buildStringValue(madpostgres__Value_JsonB, pqValue, 0, ctx);
+}
+
+
+// Binary numerics are a digit count, the weight of the first digit, a sign and
+// a display scale as int16, followed by the base 10000 digits. The value is
+// the sum of digit[i] * 10000^(weight - i).
+#define MADPOSTGRES_NUMERIC_POS 0x0000
+#define MADPOSTGRES_NUMERIC_NEG 0x4000
+#define MADPOSTGRES_NUMERIC_NAN 0xC000
+#define MADPOSTGRES_NUMERIC_PINF 0xD000
+#define MADPOSTGRES_NUMERIC_NINF 0xF000
+
+int16_t madpostgres__readInt16(const char *input) {
+  uint16_t value;
+  memcpy(&value, input, 2);
+  return (int16_t)ntohs(value);
+}
+
+
+// exact decimal representation, with dscale digits after the point
+char *madpostgres__formatNumeric(const char *digits, int ndigits, int weight, uint16_t sign, int dscale) {
+  switch (sign) {
+    case MADPOSTGRES_NUMERIC_NAN:
+      return (char*)"NaN";
+
+    case MADPOSTGRES_NUMERIC_PINF:
+      return (char*)"Infinity";
+
+    case MADPOSTGRES_NUMERIC_NINF:
+      return (char*)"-Infinity";
+  }
+
+  // the fractional part is written 4 digits at a time, then cut at dscale
+  size_t size = 2 + (weight >= 0 ? (weight + 1) * 4 : 1) + 1 + dscale + 4;
+  char *output = (char*)GC_MALLOC_ATOMIC(size);
+  char *cursor = output;
+
+  if (sign == MADPOSTGRES_NUMERIC_NEG) {
+    *cursor++ = '-';
+  }
+
+  if (weight < 0) {
+    *cursor++ = '0';
+  }
+
+  for (int d = 0; d <= weight; d++) {
+    int digit = d < ndigits ? madpostgres__readInt16(digits + d * 2) : 0;
+    cursor += sprintf(cursor, d == 0 ? "%d" : "%04d", digit);
+  }
+
+  if (dscale > 0) {
+    *cursor++ = '.';
+    char *fraction = cursor;
+
+    for (int d = weight + 1; cursor - fraction < dscale; d++) {
+      int digit = d >= 0 && d < ndigits ? madpostgres__readInt16(digits + d * 2) : 0;
+      cursor += sprintf(cursor, "%04d", digit);
+    }
+
+    cursor = fraction + dscale;
+  }
+
+  *cursor = '\0';
+  return output;
+}
+
+
+// numerics that fit in an int64 once scaled, ie. all of them up to
+// NUMERIC(18, s), become Numeric(unscaled, scale) without going through a
+// string. The others are kept exact as NumericText.
+madpostgres__Value_t *madpostgres__buildNumericValue(char *pqValue, int length, madpostgres__DecodeContext_t *ctx) {
+  if (length < 8) {
+    return &madpostgres__notImplementedValue;
+  }
+
+  int ndigits = madpostgres__readInt16(pqValue);
+  int weight = madpostgres__readInt16(pqValue + 2);
+  uint16_t sign = (uint16_t)madpostgres__readInt16(pqValue + 4);
+  int dscale = madpostgres__readInt16(pqValue + 6);
+  const char *digits = pqValue + 8;
+
+  if (ndigits < 0 || length < 8 + ndigits * 2) {
+    return &madpostgres__notImplementedValue;
+  }
+
+  madpostgres__Value_t *res = madpostgres__allocValue(ctx);
+
+  if (sign == MADPOSTGRES_NUMERIC_POS || sign == MADPOSTGRES_NUMERIC_NEG) {
+    // the last group can carry up to 3 padding zeros past dscale, which
+    // would overflow an int64 before being divided back
+    __int128 unscaled = 0;
+    bool fits = true;
+
+    for (int d = 0; d < ndigits && fits; d++) {
+      fits = !__builtin_mul_overflow(unscaled, 10000, &unscaled)
+        && !__builtin_add_overflow(unscaled, madpostgres__readInt16(digits + d * 2), &unscaled);
+    }
+
+    // the digits are aligned on groups of 4, the ones past dscale are zeros
+    int exponent = 4 * (weight - ndigits + 1) + dscale;
+    for (; exponent > 0 && fits; exponent--) {
+      fits = !__builtin_mul_overflow(unscaled, 10, &unscaled);
+    }
+    for (; exponent < 0; exponent++) {
+      unscaled /= 10;
+    }
+
+    if (fits && unscaled <= INT64_MAX) {
+      int64_t value = (int64_t)unscaled;
+      res->index = madpostgres__Value_Numeric;
+      res->data1 = (void*)(sign == MADPOSTGRES_NUMERIC_NEG ? -value : value);
+      res->data2 = (void*)(int64_t)dscale;
+      return res;
+    }
+  }
+
+  res->index = madpostgres__Value_NumericText;
+  res->data1 = (void*)madpostgres__formatNumeric(digits, ndigits, weight, sign, dscale);
   return res;
 }
 
 
-madpostgres__Value_t *madpostgres__buildJsonValue(char *pqValue) {
-  madpostgres__Value_t *res = madpostgres__buildTextValue(pqValue);
-  res->index = madpostgres__Value_Json;
+madpostgres__Value_t *madpostgres__buildNotImplemented(char *pqValue, int length, madpostgres__DecodeContext_t *ctx) {
+  return &madpostgres__notImplementedValue;
+}
+
+
+// each byte array owns its bytes, ByteArray functions may grow them in place
+madlib__bytearray__ByteArray_t *madpostgres__copyBytes(char *bytes, int length, madpostgres__DecodeContext_t *ctx) {
+  madlib__bytearray__ByteArray_t *byteArray = madpostgres__allocByteArray(ctx);
+  byteArray->bytes = (unsigned char*)GC_MALLOC_ATOMIC(length > 0 ? length : 1);
+  memcpy(byteArray->bytes, bytes, length);
+  byteArray->length = length;
+  byteArray->capacity = length;
+  return byteArray;
+}
+
+
+madpostgres__Value_t *madpostgres__buildByteAValue(char *pqValue, int length, madpostgres__DecodeContext_t *ctx) {
+  madpostgres__Value_t *res = madpostgres__allocValue(ctx);
+  res->index = madpostgres__Value_ByteA;
+  res->data1 = (void*)madpostgres__copyBytes(pqValue, length, ctx);
   return res;
 }
 
 
-madpostgres__Value_t *madpostgres__buildJsonBValue(char *pqValue) {
-  madpostgres__Value_t *res = madpostgres__buildTextValue(pqValue);
-  res->index = madpostgres__Value_JsonB;
+// the two halves of the 16 bytes, most significant first
+madpostgres__Value_t *madpostgres__buildUuidValue(char *pqValue, int length, madpostgres__DecodeContext_t *ctx) {
+  if (length != 16) {
+    return &madpostgres__notImplementedValue;
+  }
+
+  int64_t halves[2];
+  be_to_host64(halves, pqValue, 2);
+
+  madpostgres__Value_t *res = madpostgres__allocValue(ctx);
+  res->index = madpostgres__Value_Uuid;
+  res->data1 = (void*)halves[0];
+  res->data2 = (void*)halves[1];
   return res;
 }
 
 
-madpostgres__Value_t *madpostgres__buildNotImplemented(char *pqValue) {
-  madpostgres__Value_t *res = (madpostgres__Value_t*) GC_MALLOC(sizeof(madpostgres__Value_t));
-  res->index = madpostgres__Value_NotImplemented;
+// inet and cidr are a family, the prefix length in bits, a cidr flag and the
+// number of address bytes, 4 or 16, followed by the address
+madpostgres__Value_t *madpostgres__buildInetValue(char *pqValue, int length, madpostgres__DecodeContext_t *ctx) {
+  if (length < 4 || (pqValue[3] != 4 && pqValue[3] != 16) || length != 4 + pqValue[3]) {
+    return &madpostgres__notImplementedValue;
+  }
+
+  madpostgres__Value_t *res = madpostgres__allocValue(ctx);
+  res->index = madpostgres__Value_Inet;
+  res->data1 = (void*)madpostgres__copyBytes(pqValue + 4, pqValue[3], ctx);
+  res->data2 = (void*)(int64_t)(unsigned char)pqValue[1];
   return res;
 }
 
 
-madpostgres__ValueParser *madpostgres__buildValueParserArray(int colCount, PGresult *res) {
-  madpostgres__ValueParser *result = (madpostgres__ValueParser*)GC_MALLOC_ATOMIC(sizeof(madpostgres__ValueParser) * colCount);
+bool madpostgres__isTextOid(Oid type) {
+  return type == TEXTOID || type == VARCHAROID || type == JSONOID || type == JSONBOID;
+}
+
+
+bool madpostgres__isByteArrayOid(Oid type) {
+  return type == BYTEAOID || type == INETOID || type == CIDROID;
+}
+
+
+// size of the cells of the types decoded column at a time, 0 for the others
+size_t madpostgres__fixedWidth(Oid type) {
+  switch(type) {
+    case INT2OID:
+      return 2;
+
+    case INT4OID:
+    case FLOAT4OID:
+    case DATEOID:
+      return 4;
+
+    case INT8OID:
+    case FLOAT8OID:
+    case TIMESTAMPOID:
+    case TIMESTAMPTZOID:
+    case MONEYOID:
+      return 8;
+
+    default:
+      return 0;
+  }
+}
+
+
+// Byte swaps count packed cells of type in batches, then widens them to int64
+// or double in out. Dates and timestamps end up in ms. 8 bytes cells may be
+// packed in out itself.
+void madpostgres__widenFixedCells(Oid type, char *packed, size_t count, madpostgres__Cell_t *out) {
+  switch (madpostgres__fixedWidth(type)) {
+    case 2:
+      be_to_host16(packed, packed, count);
+      for (size_t i = 0; i < count; i++) {
+        int16_t n;
+        memcpy(&n, packed + i * 2, 2);
+        out[i].i = n;
+      }
+      break;
+
+    case 4:
+      be_to_host32(packed, packed, count);
+      for (size_t i = 0; i < count; i++) {
+        int32_t n;
+        memcpy(&n, packed + i * 4, 4);
+        if (type == FLOAT4OID) {
+          float f;
+          memcpy(&f, &n, 4);
+          out[i].f = f;
+        } else if (type == DATEOID) {
+          out[i].i = (int64_t)n * 24 * 60 * 60 * 1000 + 946684800000;
+        } else {
+          out[i].i = n;
+        }
+      }
+      break;
+
+    case 8:
+      be_to_host64(out, packed, count);
+      if (type == TIMESTAMPOID || type == TIMESTAMPTZOID) {
+        for (size_t i = 0; i < count; i++) {
+          out[i].i = (out[i].i + 946684800000000) / 1000;
+        }
+      }
+      break;
+  }
+}
+
+
+// Decodes a whole fixed width column in out: the cells are gathered back to
+// back, then widened. NULL cells are 0.
+void madpostgres__decodeFixedColumn(PGresult *res, int col, int rowCount, madpostgres__Cell_t *out) {
+  Oid type = PQftype(res, col);
+  size_t width = madpostgres__fixedWidth(type);
+  // 8 bytes cells are swapped in place, narrower ones need room to widen
+  char *packed = width == 8 ? (char*)out : (char*)malloc(width * (rowCount > 0 ? rowCount : 1));
+
+  for (int row = 0; row < rowCount; row++) {
+    if (PQgetisnull(res, row, col) || PQgetlength(res, row, col) != (int)width) {
+      memset(packed + row * width, 0, width);
+    } else {
+      memcpy(packed + row * width, PQgetvalue(res, row, col), width);
+    }
+  }
 
-  for (int i=0; i<colCount; i++) {
-    switch(PQftype(res, i)) {
-      case INT8OID:
-        result[i] = madpostgres__buildInt8Value;
-        break;
+  madpostgres__widenFixedCells(type, packed, rowCount, out);
 
-      case INT4OID:
-        result[i] = madpostgres__buildInt4Value;
-        break;
+  // a zeroed date or timestamp is the postgres epoch
+  if (type == DATEOID || type == TIMESTAMPOID || type == TIMESTAMPTZOID) {
+    for (int row = 0; row < rowCount; row++) {
+      if (PQgetisnull(res, row, col)) {
+        out[row].i = 0;
+      }
+    }
+  }
 
-      case INT2OID:
-        result[i] = madpostgres__buildInt2Value;
-        break;
+  if (packed != (char*)out) {
+    free(packed);
+  }
+}
 
-      case FLOAT8OID:
-        result[i] = madpostgres__buildFloat8Value;
-        break;
 
-      case FLOAT4OID:
-        result[i] = madpostgres__buildFloat4Value;
-        break;
+int32_t madpostgres__readInt32(const char *input) {
+  uint32_t value;
+  memcpy(&value, input, 4);
+  return (int32_t)ntohl(value);
+}
 
-      case JSONOID:
-        result[i] = madpostgres__buildJsonValue;
-        break;
 
-      case JSONBOID:
-        result[i] = madpostgres__buildJsonBValue;
-        break;
+// parsers of the types whose cells are decoded from their bytes, used for the
+// elements of arrays
+madpostgres__ValueParser madpostgres__bytesParser(Oid type) {
+  switch (type) {
+    case TEXTOID:
+      return madpostgres__buildTextValue;
 
-      case VARCHAROID:
-        result[i] = madpostgres__buildVarCharValue;
-        break;
+    case VARCHAROID:
+      return madpostgres__buildVarCharValue;
 
-      case TEXTOID:
-        result[i] = madpostgres__buildTextValue;
-        break;
+    case JSONOID:
+      return madpostgres__buildJsonValue;
 
-      case TIMESTAMPOID:
-        result[i] = madpostgres__buildTimestampValue;
-        break;
+    case JSONBOID:
+      return madpostgres__buildJsonBValue;
 
-      case TIMESTAMPTZOID:
-        result[i] = madpostgres__buildTimestampTzValue;
-        break;
+    case BOOLOID:
+      return madpostgres__buildBooleanValue;
 
-      case DATEOID:
-        result[i] = madpostgres__buildDateValue;
-        break;
+    case NUMERICOID:
+      return madpostgres__buildNumericValue;
 
-      case BOOLOID:
-        result[i] = madpostgres__buildBooleanValue;
-        break;
+    default:
+      return madpostgres__buildNotImplemented;
+  }
+}
 
-      case MONEYOID:
-        result[i] = madpostgres__buildMoneyValue;
-        break;
 
-      default:
-        result[i] = madpostgres__buildNotImplemented;
-        break;
+// The elements of an array get their own arenas, sized from its dimensions,
+// the nested lists of multidimensional arrays included
+void madpostgres__initArrayContext(
+  madpostgres__DecodeContext_t *ctx,
+  Oid elementType,
+  int ndim,
+  int *dims,
+  size_t count,
+  size_t textBytes
+) {
+  size_t listCount = 1;
+  size_t nodeCount = 0;
+  size_t innerCount = 0;
+
+  for (int d = 0; d < ndim; d++) {
+    nodeCount += listCount * (dims[d] + 1);
+    if (d > 0) {
+      innerCount += listCount;
     }
+    listCount *= dims[d];
   }
 
-  return result;
+  bool dateTimes = elementType == DATEOID || elementType == TIMESTAMPOID || elementType == TIMESTAMPTZOID;
+  bool floats = elementType == FLOAT4OID || elementType == FLOAT8OID;
+
+  memset(ctx, 0, sizeof(madpostgres__DecodeContext_t));
+  ctx->slab = textBytes > 0 ? (char*)GC_MALLOC_ATOMIC(textBytes) : NULL;
+  ctx->values = (madpostgres__Value_t*)GC_MALLOC(sizeof(madpostgres__Value_t) * (count + innerCount + 1));
+  ctx->dateTimes = dateTimes && count > 0
+    ? (madpostgres__MadlibADT_t*)GC_MALLOC_ATOMIC(sizeof(madpostgres__MadlibADT_t) * count)
+    : NULL;
+  ctx->floats = floats && count > 0 ? (double*)GC_MALLOC_ATOMIC(sizeof(double) * count) : NULL;
+  ctx->nodes = (madlib__list__Node_t*)GC_MALLOC(sizeof(madlib__list__Node_t) * (nodeCount + 1));
 }
 
 
-void madpostgres__handleQueryResult(void *callbacks, PGresult* res) {
-  madpostgres__Callbacks_t *typedCallbacks = (madpostgres__Callbacks_t*)callbacks;
-  int err = pquv_get_error(typedCallbacks->connection);
+// builds the list of dimension level, taking the elements in order from
+// values
+madlib__list__Node_t *madpostgres__buildArrayList(
+  madpostgres__DecodeContext_t *ctx,
+  int ndim,
+  int *dims,
+  int level,
+  madpostgres__Value_t **values,
+  size_t *next
+) {
+  madlib__list__Node_t *list = madpostgres__allocList(ctx, dims[level]);
+
+  for (int i = 0; i < dims[level]; i++) {
+    if (level == ndim - 1) {
+      list[i].value = values[(*next)++];
+    } else {
+      madpostgres__Value_t *inner = madpostgres__allocValue(ctx);
+      inner->index = madpostgres__Value_Array;
+      inner->data1 = madpostgres__buildArrayList(ctx, ndim, dims, level + 1, values, next);
+      list[i].value = inner;
+    }
+  }
 
-  if (err > 0) {
-    char *errMessage = pquv_get_errorMessage(typedCallbacks->connection);
-    __applyPAP__(typedCallbacks->badCB, 2, err, errMessage);
-    return;
+  return list;
+}
+
+
+// Binary arrays are a dimension count, a has-NULL flag and the element type,
+// then the size and lower bound of each dimension, then each element as a
+// length, -1 for NULL, followed by its bytes. Multidimensional arrays become
+// nested ArrayValues.
+madpostgres__Value_t *madpostgres__buildArrayValue(char *pqValue, int length, madpostgres__DecodeContext_t *ctx) {
+  if (length < 12) {
+    return &madpostgres__notImplementedValue;
   }
 
-  int rowCount = PQntuples(res);
-  int colCount = PQnfields(res);
-  madpostgres__ValueParser *valueParsers = madpostgres__buildValueParserArray(colCount, res);
+  int ndim = madpostgres__readInt32(pqValue);
+  Oid elementType = (Oid)madpostgres__readInt32(pqValue + 8);
+  int dims[MADPOSTGRES_ARRAY_MAX_DIMS];
+  size_t count = ndim > 0 ? 1 : 0;
 
+  if (ndim < 0 || ndim > MADPOSTGRES_ARRAY_MAX_DIMS || length < 12 + ndim * 8) {
+    return &madpostgres__notImplementedValue;
+  }
 
-  madlib__list__Node_t *result = madlib__list__empty();
+  for (int d = 0; d < ndim; d++) {
+    dims[d] = madpostgres__readInt32(pqValue + 12 + d * 8);
+    // each element takes at least 4 bytes
+    if (dims[d] < 0 || (dims[d] > 0 && count > (size_t)length / 4 / dims[d])) {
+      return &madpostgres__notImplementedValue;
+    }
+    count *= dims[d];
+  }
 
-  for (int row = rowCount - 1; row >= 0; row--) {
-    madlib__list__Node_t *rowValues = madlib__list__empty();
+  char **elements = (char**)malloc(sizeof(char*) * (count > 0 ? count : 1));
+  int *lengths = (int*)malloc(sizeof(int) * (count > 0 ? count : 1));
+  madpostgres__Value_t **values = (madpostgres__Value_t**)malloc(sizeof(madpostgres__Value_t*) * (count > 0 ? count : 1));
+  const char *cursor = pqValue + 12 + ndim * 8;
+  const char *end = pqValue + length;
+  size_t textBytes = 0;
+  madpostgres__Value_t *res = &madpostgres__notImplementedValue;
+
+  for (size_t i = 0; i < count; i++) {
+    if (end - cursor < 4) {
+      goto done;
+    }
+
+    lengths[i] = madpostgres__readInt32(cursor);
+    cursor += 4;
+
+    if (lengths[i] < 0) {
+      elements[i] = NULL;
+    } else if (end - cursor < lengths[i]) {
+      goto done;
+    } else {
+      elements[i] = (char*)cursor;
+      cursor += lengths[i];
+      textBytes += lengths[i] + 1;
+    }
+  }
 
-    for (int col = colCount - 1; col >= 0; col--) {
-      char *pqValue = PQgetvalue(res, row, col);
-      void *madlibValue = valueParsers[col](pqValue);
-      rowValues = madlib__list__push(madlibValue, rowValues);
+  {
+    size_t width = madpostgres__fixedWidth(elementType);
+    madpostgres__DecodeContext_t arrayCtx;
+    madpostgres__initArrayContext(&arrayCtx, elementType, ndim, dims, count, width > 0 ? 0 : textBytes);
+
+    if (width > 0) {
+      // fixed width elements are gathered and swapped in bulk like columns
+      char *packed = (char*)malloc(width * (count > 0 ? count : 1));
+      madpostgres__Cell_t *cells = (madpostgres__Cell_t*)malloc(sizeof(madpostgres__Cell_t) * (count > 0 ? count : 1));
+
+      for (size_t i = 0; i < count; i++) {
+        if (lengths[i] == (int)width) {
+          memcpy(packed + i * width, elements[i], width);
+        } else {
+          memset(packed + i * width, 0, width);
+        }
+      }
+
+      madpostgres__widenFixedCells(elementType, packed, count, cells);
+
+      for (size_t i = 0; i < count; i++) {
+        values[i] = lengths[i] == (int)width
+          ? madpostgres__buildFixedValue(elementType, cells[i], &arrayCtx)
+          : &madpostgres__notImplementedValue;
+      }
+
+      free(packed);
+      free(cells);
+    } else {
+      madpostgres__ValueParser parse = madpostgres__bytesParser(elementType);
+
+      for (size_t i = 0; i < count; i++) {
+        values[i] = elements[i] == NULL
+          ? &madpostgres__notImplementedValue
+          : parse(elements[i], lengths[i], &arrayCtx);
+      }
     }
 
-    result = madlib__list__push(rowValues, result);
+    size_t next = 0;
+    res = madpostgres__allocValue(ctx);
+    res->index = madpostgres__Value_Array;
+    res->data1 = ndim == 0
+      ? madpostgres__allocList(&arrayCtx, 0)
+      : madpostgres__buildArrayList(&arrayCtx, ndim, dims, 0, values, &next);
   }
 
-  __applyPAP__(typedCallbacks->goodCB, 1, result);
+done:
+  free(elements);
+  free(lengths);
+  free(values);
+  return res;
 }
 
 
-void madpostgres__query(pquv_t *connection, char *query, PAP_t *badCB, PAP_t *goodCB) {
-  int err = pquv_get_error(connection);
-  char *errMessage = pquv_get_errorMessage(connection);
-  bool alreadyDisconnected = pquv_get_disconnected(connection);
-  // printf("errMessage: %s\n", errMessage);
-  if (alreadyDisconnected) {
-    // TODO: allocate the string
-    __applyPAP__(badCB, 2, 1, "Connection is already closed.");
+// Everything decoded from a result is allocated up front in a few blocks
+// sized from its shape: all the text cells are copied in a single slab, and
+// Values, DateTimes, boxed floats and list nodes each get an arena. The
+// blocks stay alive as long as any cell of the result is referenced.
+// withRowList reserves the nodes of the list of rows.
+void madpostgres__initDecodeContext(madpostgres__DecodeContext_t *ctx, PGresult *res, bool withRowList) {
+  int rowCount = PQntuples(res);
+  int colCount = PQnfields(res);
+  size_t total = 0;
+  size_t dateTimeCount = 0;
+  size_t floatCount = 0;
+  size_t byteArrayCount = 0;
+  bool hasText = false;
+
+  if (!madpostgres__smallIntsReady) {
+    madpostgres__initSmallInts();
   }
-  else if (err) {
-    if (err == 1 && !alreadyDisconnected) {
-      // if connection is bad we close it
-      madpostgres__disconnect(connection);
+
+  for (int col = 0; col < colCount; col++) {
+    Oid type = PQftype(res, col);
+
+    if (madpostgres__isTextOid(type)) {
+      hasText = true;
+      for (int row = 0; row < rowCount; row++) {
+        total += PQgetlength(res, row, col) + 1;
+      }
+    } else if (type == TIMESTAMPOID || type == TIMESTAMPTZOID || type == DATEOID) {
+      dateTimeCount += rowCount;
+    } else if (type == FLOAT8OID || type == FLOAT4OID) {
+      floatCount += rowCount;
+    } else if (madpostgres__isByteArrayOid(type)) {
+      byteArrayCount += rowCount;
+    }
+  }
+
+  // fixed width columns are decoded up front, a column at a time
+  ctx->cells = (madpostgres__Cell_t**)GC_MALLOC(sizeof(madpostgres__Cell_t*) * (colCount > 0 ? colCount : 1));
+  for (int col = 0; col < colCount; col++) {
+    if (madpostgres__fixedWidth(PQftype(res, col)) > 0 && rowCount > 0) {
+      ctx->cells[col] = (madpostgres__Cell_t*)GC_MALLOC_ATOMIC(sizeof(madpostgres__Cell_t) * rowCount);
+      madpostgres__decodeFixedColumn(res, col, rowCount, ctx->cells[col]);
     }
-    __applyPAP__(badCB, 2, err, errMessage);
-  } else {
-    madpostgres__Callbacks_t *callbacks = (madpostgres__Callbacks_t*) GC_MALLOC(sizeof(madpostgres__Callbacks_t));
-    callbacks->badCB = badCB;
-    callbacks->goodCB = goodCB;
-    callbacks->connection = connection;
-    pquv_query(connection, query, madpostgres__handleQueryResult, (void*)callbacks);
   }
+
+  size_t valueCount = (size_t)rowCount * colCount;
+  size_t nodeCount = (size_t)rowCount * (colCount + 1) + (withRowList ? rowCount + 1 : 0);
+
+  ctx->slab = total > 0 ? (char*)GC_MALLOC_ATOMIC(total) : NULL;
+  ctx->slabOffset = 0;
+  ctx->values = valueCount > 0 ? (madpostgres__Value_t*)GC_MALLOC(sizeof(madpostgres__Value_t) * valueCount) : NULL;
+  ctx->valueOffset = 0;
+  ctx->dateTimes = dateTimeCount > 0
+    ? (madpostgres__MadlibADT_t*)GC_MALLOC_ATOMIC(sizeof(madpostgres__MadlibADT_t) * dateTimeCount)
+    : NULL;
+  ctx->dateTimeOffset = 0;
+  ctx->floats = floatCount > 0 ? (double*)GC_MALLOC_ATOMIC(sizeof(double) * floatCount) : NULL;
+  ctx->floatOffset = 0;
+  ctx->byteArrays = byteArrayCount > 0
+    ? (madlib__bytearray__ByteArray_t*)GC_MALLOC(sizeof(madlib__bytearray__ByteArray_t) * byteArrayCount)
+    : NULL;
+  ctx->byteArrayOffset = 0;
+  ctx->nodes = (madlib__list__Node_t*)GC_MALLOC(sizeof(madlib__list__Node_t) * nodeCount);
+  ctx->nodeOffset = 0;
+  ctx->rowCount = rowCount;
+  ctx->colCount = colCount;
+  ctx->col = 0;
+  ctx->row = 0;
+  // tables are allocated per column on first use, interning a handful of rows
+  // isn't worth it
+  ctx->interns = hasText && rowCount >= MADPOSTGRES_INTERN_MIN_ROWS
+    ? (madpostgres__InternTable_t**)GC_MALLOC(sizeof(madpostgres__InternTable_t*) * colCount)
+    : NULL;
+}
+
+
+} // extern "C"
+
+// One decoder is instantiated per parser so that the parser is inlined in the
+// loop over the rows. Fixed width parsers read the cells decoded by
+// madpostgres__decodeFixedColumn and don't need the bytes of the cell.
+template <madpostgres__ValueParser parse, bool readsBytes>
+void madpostgres__decodeColumn(PGresult *res, int col, madlib__list__Node_t *rows, madpostgres__DecodeContext_t *ctx) {
+  int stride = ctx->colCount + 1;
+  ctx->col = col;
+
+  for (int row = 0; row < ctx->rowCount; row++) {
+    madlib__list__Node_t *node = &rows[row * stride + col];
+    ctx->row = row;
+
+    if (PQgetisnull(res, row, col)) {
+      node->value = &madpostgres__notImplementedValue;
+    } else if (readsBytes) {
+      node->value = parse(PQgetvalue(res, row, col), PQgetlength(res, row, col), ctx);
+    } else {
+      node->value = parse(NULL, 0, ctx);
+    }
+  }
+}
+
+extern "C" {
+
+
+madpostgres__ColumnDecoder madpostgres__columnDecoder(Oid type) {
+  switch(type) {
+    case INT8OID:
+      return madpostgres__decodeColumn<madpostgres__buildInt8Value, false>;
+
+    case INT4OID:
+      return madpostgres__decodeColumn<madpostgres__buildInt4Value, false>;
+
+    case INT2OID:
+      return madpostgres__decodeColumn<madpostgres__buildInt2Value, false>;
+
+    case FLOAT8OID:
+      return madpostgres__decodeColumn<madpostgres__buildFloat8Value, false>;
+
+    case FLOAT4OID:
+      return madpostgres__decodeColumn<madpostgres__buildFloat4Value, false>;
+
+    case JSONOID:
+      return madpostgres__decodeColumn<madpostgres__buildJsonValue, true>;
+
+    case JSONBOID:
+      return madpostgres__decodeColumn<madpostgres__buildJsonBValue, true>;
+
+    case VARCHAROID:
+      return madpostgres__decodeColumn<madpostgres__buildVarCharValue, true>;
+
+    case TEXTOID:
+      return madpostgres__decodeColumn<madpostgres__buildTextValue, true>;
+
+    case TIMESTAMPOID:
+      return madpostgres__decodeColumn<madpostgres__buildTimestampValue, false>;
+
+    case TIMESTAMPTZOID:
+      return madpostgres__decodeColumn<madpostgres__buildTimestampTzValue, false>;
+
+    case DATEOID:
+      return madpostgres__decodeColumn<madpostgres__buildDateValue, false>;
+
+    case BOOLOID:
+      return madpostgres__decodeColumn<madpostgres__buildBooleanValue, true>;
+
+    case MONEYOID:
+      return madpostgres__decodeColumn<madpostgres__buildMoneyValue, false>;
+
+    case NUMERICOID:
+      return madpostgres__decodeColumn<madpostgres__buildNumericValue, true>;
+
+    case BYTEAOID:
+      return madpostgres__decodeColumn<madpostgres__buildByteAValue, true>;
+
+    case UUIDOID:
+      return madpostgres__decodeColumn<madpostgres__buildUuidValue, true>;
+
+    case INETOID:
+    case CIDROID:
+      return madpostgres__decodeColumn<madpostgres__buildInetValue, true>;
+
+    case BOOLARRAYOID:
+    case INT2ARRAYOID:
+    case INT4ARRAYOID:
+    case INT8ARRAYOID:
+    case FLOAT4ARRAYOID:
+    case FLOAT8ARRAYOID:
+    case MONEYARRAYOID:
+    case NUMERICARRAYOID:
+    case TEXTARRAYOID:
+    case VARCHARARRAYOID:
+    case JSONARRAYOID:
+    case JSONBARRAYOID:
+    case DATEARRAYOID:
+    case TIMESTAMPARRAYOID:
+    case TIMESTAMPTZARRAYOID:
+      return madpostgres__decodeColumn<madpostgres__buildArrayValue, true>;
+
+    default:
+      return madpostgres__decodeColumn<madpostgres__buildNotImplemented, false>;
+  }
+}
+
+
+// plans are cached by the OIDs of their columns, the same queries keep
+// returning the same shapes
+madpostgres__DecodePlan_t *madpostgres__planCache[MADPOSTGRES_PLAN_CACHE_SIZE];
+
+
+madpostgres__DecodePlan_t *madpostgres__decodePlan(PGresult *res) {
+  int colCount = PQnfields(res);
+  uint32_t hash = 2166136261u;
+
+  for (int col = 0; col < colCount; col++) {
+    hash = (hash ^ PQftype(res, col)) * 16777619u;
+  }
+
+  madpostgres__DecodePlan_t *plan = madpostgres__planCache[hash % MADPOSTGRES_PLAN_CACHE_SIZE];
+  if (plan != NULL && plan->colCount == colCount) {
+    int col = 0;
+    while (col < colCount && plan->types[col] == PQftype(res, col)) {
+      col++;
+    }
+
+    if (col == colCount) {
+      return plan;
+    }
+  }
+
+  plan = (madpostgres__DecodePlan_t*)GC_MALLOC(sizeof(madpostgres__DecodePlan_t));
+  plan->colCount = colCount;
+  plan->types = (Oid*)GC_MALLOC_ATOMIC(sizeof(Oid) * (colCount > 0 ? colCount : 1));
+  plan->decoders = (madpostgres__ColumnDecoder*)GC_MALLOC_ATOMIC(sizeof(madpostgres__ColumnDecoder) * (colCount > 0 ? colCount : 1));
+
+  for (int col = 0; col < colCount; col++) {
+    plan->types[col] = PQftype(res, col);
+    plan->decoders[col] = madpostgres__columnDecoder(plan->types[col]);
+  }
+
+  madpostgres__planCache[hash % MADPOSTGRES_PLAN_CACHE_SIZE] = plan;
+  return plan;
+}
+
+
+void hton64(char *output, int64_t input) {
+  uint64_t value = (uint64_t)input;
+
+  output[0] = value >> 56;
+  output[1] = value >> 48;
+  output[2] = value >> 40;
+  output[3] = value >> 32;
+  output[4] = value >> 24;
+  output[5] = value >> 16;
+  output[6] = value >> 8;
+  output[7] = value >> 0;
+}
+
+
+void hton32(char *output, int32_t input) {
+  uint32_t value = (uint32_t)input;
+
+  output[0] = value >> 24;
+  output[1] = value >> 16;
+  output[2] = value >> 8;
+  output[3] = value >> 0;
+}
+
+
+void hton16(char *output, int16_t input) {
+  uint16_t value = (uint16_t)input;
+
+  output[0] = value >> 8;
+  output[1] = value >> 0;
+}
+
+
+// base 10000 digit g of a decimal, its integer part being left padded and its
+// fractional part right padded with zeros to groups of 4 digits
+int madpostgres__numericGroup(const char *integer, int integerLength, const char *fraction, int fractionLength, int g) {
+  int integerPadded = (integerLength + 3) / 4 * 4;
+  int group = 0;
+
+  for (int j = g * 4; j < g * 4 + 4; j++) {
+    int index = j < integerPadded ? j - (integerPadded - integerLength) : j - integerPadded;
+    char digit = j < integerPadded
+      ? (index < 0 ? '0' : integer[index])
+      : (index < fractionLength ? fraction[index] : '0');
+    group = group * 10 + digit - '0';
+  }
+
+  return group;
+}
+
+
+// Writes the binary numeric representation of a decimal string, or only
+// computes its length when output is NULL. Returns -1 when str is not a
+// number.
+int madpostgres__encodeNumeric(const char *str, char *output) {
+  uint16_t sign = MADPOSTGRES_NUMERIC_POS;
+  const char *cursor = str;
+
+  if (strcmp(str, "NaN") == 0) {
+    sign = MADPOSTGRES_NUMERIC_NAN;
+  } else if (strcmp(str, "Infinity") == 0) {
+    sign = MADPOSTGRES_NUMERIC_PINF;
+  } else if (strcmp(str, "-Infinity") == 0) {
+    sign = MADPOSTGRES_NUMERIC_NINF;
+  }
+
+  if (sign != MADPOSTGRES_NUMERIC_POS) {
+    if (output != NULL) {
+      hton16(output, 0);
+      hton16(output + 2, 0);
+      hton16(output + 4, sign);
+      hton16(output + 6, 0);
+    }
+    return 8;
+  }
+
+  if (*cursor == '-' || *cursor == '+') {
+    sign = *cursor == '-' ? MADPOSTGRES_NUMERIC_NEG : MADPOSTGRES_NUMERIC_POS;
+    cursor++;
+  }
+
+  const char *integer = cursor;
+  while (*cursor >= '0' && *cursor <= '9') cursor++;
+  int integerLength = cursor - integer;
+
+  const char *fraction = cursor;
+  int fractionLength = 0;
+  if (*cursor == '.') {
+    fraction = ++cursor;
+    while (*cursor >= '0' && *cursor <= '9') cursor++;
+    fractionLength = cursor - fraction;
+  }
+
+  if (*cursor != '\0' || integerLength + fractionLength == 0) {
+    return -1;
+  }
+
+  int integerGroups = (integerLength + 3) / 4;
+  int groupCount = integerGroups + (fractionLength + 3) / 4;
+  int first = -1;
+  int last = -1;
+
+  for (int g = 0; g < groupCount; g++) {
+    if (madpostgres__numericGroup(integer, integerLength, fraction, fractionLength, g) != 0) {
+      if (first < 0) first = g;
+      last = g;
+    }
+  }
+
+  // leading and trailing zero groups are left out, zero has no digits
+  int ndigits = first < 0 ? 0 : last - first + 1;
+  int weight = first < 0 ? 0 : integerGroups - 1 - first;
+
+  if (output != NULL) {
+    hton16(output, ndigits);
+    hton16(output + 2, weight);
+    hton16(output + 4, ndigits == 0 ? MADPOSTGRES_NUMERIC_POS : sign);
+    hton16(output + 6, fractionLength);
+    for (int d = 0; d < ndigits; d++) {
+      hton16(output + 8 + d * 2, madpostgres__numericGroup(integer, integerLength, fraction, fractionLength, first + d));
+    }
+  }
+
+  return 8 + ndigits * 2;
+}
+
+
+// decimal string of unscaled / 10^scale
+char *madpostgres__numericString(madpostgres__Value_t *value) {
+  int64_t unscaled = (int64_t)value->data1;
+  int64_t scale = (int64_t)value->data2;
+  uint64_t magnitude = unscaled < 0 ? -(uint64_t)unscaled : (uint64_t)unscaled;
+  char digits[21];
+  int digitCount = sprintf(digits, "%llu", (unsigned long long)magnitude);
+
+  size_t size = 2 + digitCount + (scale > 0 ? scale + 1 : -scale) + 1;
+  char *output = (char*)GC_MALLOC_ATOMIC(size);
+  char *cursor = output;
+
+  if (unscaled < 0) {
+    *cursor++ = '-';
+  }
+
+  if (scale <= 0) {
+    memcpy(cursor, digits, digitCount);
+    cursor += digitCount;
+    memset(cursor, '0', -scale);
+    cursor += -scale;
+  } else {
+    int integerLength = digitCount - scale;
+
+    if (integerLength <= 0) {
+      *cursor++ = '0';
+      *cursor++ = '.';
+      memset(cursor, '0', -integerLength);
+      cursor += -integerLength;
+      memcpy(cursor, digits, digitCount);
+      cursor += digitCount;
+    } else {
+      memcpy(cursor, digits, integerLength);
+      cursor += integerLength;
+      *cursor++ = '.';
+      memcpy(cursor, digits + integerLength, scale);
+      cursor += scale;
+    }
+  }
+
+  *cursor = '\0';
+  return output;
+}
+
+
+// timestamps and dates are sent relative to the postgres epoch, 2000-01-01
+int64_t madpostgres__readDateTime(madpostgres__Value_t *value) {
+  return (int64_t)((madpostgres__MadlibADT_t*)value->data1)->data - 946684800000;
+}
+
+
+Oid madpostgres__valueOid(madpostgres__Value_t *value) {
+  switch (value->index) {
+    case madpostgres__Value_Boolean: return BOOLOID;
+    case madpostgres__Value_ByteA: return BYTEAOID;
+    case madpostgres__Value_Date: return DATEOID;
+    case madpostgres__Value_Float4: return FLOAT4OID;
+    case madpostgres__Value_Float8: return FLOAT8OID;
+    case madpostgres__Value_Inet: return INETOID;
+    case madpostgres__Value_Int2: return INT2OID;
+    case madpostgres__Value_Int4: return INT4OID;
+    case madpostgres__Value_Int8: return INT8OID;
+    case madpostgres__Value_Json: return JSONOID;
+    case madpostgres__Value_JsonB: return JSONBOID;
+    case madpostgres__Value_Money: return MONEYOID;
+    case madpostgres__Value_Numeric: return NUMERICOID;
+    case madpostgres__Value_NumericText: return NUMERICOID;
+    case madpostgres__Value_Text: return TEXTOID;
+    case madpostgres__Value_Timestamp: return TIMESTAMPOID;
+    case madpostgres__Value_TimestampTz: return TIMESTAMPTZOID;
+    case madpostgres__Value_Uuid: return UUIDOID;
+    case madpostgres__Value_VarChar: return VARCHAROID;
+    // let the server infer the type of the NULL
+    default: return 0;
+  }
+}
+
+
+// length of the binary representation of value, -1 stands for NULL
+int madpostgres__valueLength(madpostgres__Value_t *value) {
+  switch (value->index) {
+    case madpostgres__Value_Boolean:
+      return 1;
+
+    case madpostgres__Value_Int2:
+      return 2;
+
+    case madpostgres__Value_Date:
+    case madpostgres__Value_Float4:
+    case madpostgres__Value_Int4:
+      return 4;
+
+    case madpostgres__Value_Float8:
+    case madpostgres__Value_Int8:
+    case madpostgres__Value_Money:
+    case madpostgres__Value_Timestamp:
+    case madpostgres__Value_TimestampTz:
+      return 8;
+
+    case madpostgres__Value_Json:
+    case madpostgres__Value_Text:
+    case madpostgres__Value_VarChar:
+      return strlen((char*)value->data1);
+
+    case madpostgres__Value_JsonB:
+      // version byte followed by the json text
+      return 1 + strlen((char*)value->data1);
+
+    // a NumericText that isn't a number is sent as NULL
+    case madpostgres__Value_Numeric:
+      return madpostgres__encodeNumeric(madpostgres__numericString(value), NULL);
+
+    case madpostgres__Value_NumericText:
+      return madpostgres__encodeNumeric((char*)value->data1, NULL);
+
+    case madpostgres__Value_ByteA:
+      return ((madlib__bytearray__ByteArray_t*)value->data1)->length;
+
+    case madpostgres__Value_Uuid:
+      return 16;
+
+    // an address that is neither ipv4 nor ipv6 is sent as NULL
+    case madpostgres__Value_Inet: {
+      int64_t length = ((madlib__bytearray__ByteArray_t*)value->data1)->length;
+      return length == 4 || length == 16 ? 4 + length : -1;
+    }
+
+    default:
+      return -1;
+  }
+}
+
+
+// writes the binary representation of value, output must hold
+// madpostgres__valueLength(value) bytes
+void madpostgres__writeValue(madpostgres__Value_t *value, char *output) {
+  switch (value->index) {
+    case madpostgres__Value_Boolean:
+      output[0] = value->data1 ? 1 : 0;
+      break;
+
+    case madpostgres__Value_Int2:
+      hton16(output, (int16_t)(int64_t)value->data1);
+      break;
+
+    case madpostgres__Value_Int4:
+      hton32(output, (int32_t)(int64_t)value->data1);
+      break;
+
+    case madpostgres__Value_Int8:
+      hton64(output, (int64_t)value->data1);
+      break;
+
+    case madpostgres__Value_Float4: {
+      float num = (float)*(double*)value->data1;
+      int32_t bits;
+      memcpy(&bits, &num, 4);
+      hton32(output, bits);
+      break;
+    }
+
+    case madpostgres__Value_Float8: {
+      int64_t bits;
+      memcpy(&bits, value->data1, 8);
+      hton64(output, bits);
+      break;
+    }
+
+    case madpostgres__Value_Money:
+      hton64(output, (int64_t)value->data1 * 100 + (int64_t)value->data2);
+      break;
+
+    case madpostgres__Value_Date: {
+      // rounded down, a time before the epoch still belongs to the day before
+      int64_t ms = madpostgres__readDateTime(value);
+      int64_t day = ms / (24 * 60 * 60 * 1000);
+      if (ms % (24 * 60 * 60 * 1000) < 0) {
+        day -= 1;
+      }
+      hton32(output, (int32_t)day);
+      break;
+    }
+
+    case madpostgres__Value_Timestamp:
+    case madpostgres__Value_TimestampTz:
+      hton64(output, madpostgres__readDateTime(value) * 1000);
+      break;
+
+    case madpostgres__Value_Json:
+    case madpostgres__Value_Text:
+    case madpostgres__Value_VarChar:
+      memcpy(output, value->data1, strlen((char*)value->data1));
+      break;
+
+    case madpostgres__Value_JsonB:
+      output[0] = 1;
+      memcpy(output + 1, value->data1, strlen((char*)value->data1));
+      break;
+
+    case madpostgres__Value_Numeric:
+      madpostgres__encodeNumeric(madpostgres__numericString(value), output);
+      break;
+
+    case madpostgres__Value_NumericText:
+      madpostgres__encodeNumeric((char*)value->data1, output);
+      break;
+
+    case madpostgres__Value_ByteA: {
+      madlib__bytearray__ByteArray_t *byteArray = (madlib__bytearray__ByteArray_t*)value->data1;
+      memcpy(output, byteArray->bytes, byteArray->length);
+      break;
+    }
+
+    case madpostgres__Value_Uuid:
+      hton64(output, (int64_t)value->data1);
+      hton64(output + 8, (int64_t)value->data2);
+      break;
+
+    case madpostgres__Value_Inet: {
+      madlib__bytearray__ByteArray_t *address = (madlib__bytearray__ByteArray_t*)value->data1;
+      // PGSQL_AF_INET and PGSQL_AF_INET6
+      output[0] = address->length == 4 ? 2 : 3;
+      output[1] = (char)(int64_t)value->data2;
+      output[2] = 0;
+      output[3] = (char)address->length;
+      memcpy(output + 4, address->bytes, address->length);
+      break;
+    }
+
+    default:
+      break;
+  }
+}
+
+
+// encodes all values in a single buffer, the parameters point into it
+madpostgres__Params_t *madpostgres__encodeParams(madlib__list__Node_t *values) {
+  madpostgres__Params_t *params = (madpostgres__Params_t*) GC_MALLOC(sizeof(madpostgres__Params_t));
+  int count = 0;
+  size_t size = 0;
+
+  for (madlib__list__Node_t *node = values; node->next != NULL; node = node->next) {
+    int length = madpostgres__valueLength((madpostgres__Value_t*)node->value);
+    size += length > 0 ? length : 0;
+    count += 1;
+  }
+
+  params->count = count;
+  params->buffer = (char*)GC_MALLOC_ATOMIC(size > 0 ? size : 1);
+  params->types = (Oid*)GC_MALLOC_ATOMIC(sizeof(Oid) * count);
+  params->values = (char**)GC_MALLOC(sizeof(char*) * count);
+  params->lengths = (int*)GC_MALLOC_ATOMIC(sizeof(int) * count);
+  params->formats = (int*)GC_MALLOC_ATOMIC(sizeof(int) * count);
+
+  char *cursor = params->buffer;
+  int index = 0;
+  for (madlib__list__Node_t *node = values; node->next != NULL; node = node->next) {
+    madpostgres__Value_t *value = (madpostgres__Value_t*)node->value;
+    int length = madpostgres__valueLength(value);
+
+    params->types[index] = madpostgres__valueOid(value);
+    params->formats[index] = 1;
+
+    if (length < 0) {
+      params->values[index] = NULL;
+      params->lengths[index] = 0;
+    } else {
+      madpostgres__writeValue(value, cursor);
+      params->values[index] = cursor;
+      params->lengths[index] = length;
+      cursor += length;
+    }
+
+    index += 1;
+  }
+
+  return params;
+}
+
+
+#define MADPOSTGRES_COPY_CHUNK_SIZE 65536
+
+// signature, flags and header extension length of the binary COPY format
+const char madpostgres__copyHeader[19] = {
+  'P', 'G', 'C', 'O', 'P', 'Y', '\n', '\377', '\r', '\n', '\0',
+  0, 0, 0, 0,
+  0, 0, 0, 0
+};
+
+
+size_t madpostgres__copyRowLength(madlib__list__Node_t *row) {
+  size_t length = 2;
+
+  for (madlib__list__Node_t *node = row; node->next != NULL; node = node->next) {
+    int valueLength = madpostgres__valueLength((madpostgres__Value_t*)node->value);
+    length += 4 + (valueLength > 0 ? valueLength : 0);
+  }
+
+  return length;
+}
+
+
+// a tuple is its field count followed by each field as length and bytes
+size_t madpostgres__writeCopyRow(madlib__list__Node_t *row, char *output) {
+  char *cursor = output + 2;
+  int16_t fieldCount = 0;
+
+  for (madlib__list__Node_t *node = row; node->next != NULL; node = node->next) {
+    madpostgres__Value_t *value = (madpostgres__Value_t*)node->value;
+    int valueLength = madpostgres__valueLength(value);
+
+    hton32(cursor, valueLength);
+    cursor += 4;
+    if (valueLength > 0) {
+      madpostgres__writeValue(value, cursor);
+      cursor += valueLength;
+    }
+    fieldCount += 1;
+  }
+
+  hton16(output, fieldCount);
+  return cursor - output;
+}
+
+
+void madpostgres__reserveCopyBuffer(madpostgres__CopyInCallbacks_t *callbacks, size_t used, size_t needed) {
+  if (used + needed <= callbacks->capacity) {
+    return;
+  }
+
+  size_t capacity = callbacks->capacity * 2;
+  if (capacity < used + needed) {
+    capacity = used + needed;
+  }
+
+  char *buffer = (char*)GC_MALLOC_ATOMIC(capacity);
+  memcpy(buffer, callbacks->buffer, used);
+  callbacks->buffer = buffer;
+  callbacks->capacity = capacity;
+}
+
+
+// encodes rows until the chunk is full, the same buffer is reused for every
+// chunk as libpq copies it before asking for the next one
+int madpostgres__produceCopyData(void *callbacks, const char **buf) {
+  madpostgres__CopyInCallbacks_t *typedCallbacks = (madpostgres__CopyInCallbacks_t*)callbacks;
+  size_t length = 0;
+
+  if (typedCallbacks->trailerSent) {
+    return 0;
+  }
+
+  if (!typedCallbacks->headerSent) {
+    memcpy(typedCallbacks->buffer, madpostgres__copyHeader, sizeof(madpostgres__copyHeader));
+    length = sizeof(madpostgres__copyHeader);
+    typedCallbacks->headerSent = true;
+  }
+
+  while (typedCallbacks->rows->next != NULL && length < MADPOSTGRES_COPY_CHUNK_SIZE) {
+    madlib__list__Node_t *row = (madlib__list__Node_t*)typedCallbacks->rows->value;
+    madpostgres__reserveCopyBuffer(typedCallbacks, length, madpostgres__copyRowLength(row));
+    length += madpostgres__writeCopyRow(row, typedCallbacks->buffer + length);
+    typedCallbacks->rows = typedCallbacks->rows->next;
+  }
+
+  if (typedCallbacks->rows->next == NULL) {
+    madpostgres__reserveCopyBuffer(typedCallbacks, length, 2);
+    hton16(typedCallbacks->buffer + length, -1);
+    length += 2;
+    typedCallbacks->trailerSent = true;
+  }
+
+  *buf = typedCallbacks->buffer;
+  return length;
+}
+
+
+// errors produced by the server carry a SQLSTATE, the ones libpq generates
+// itself when the connection is lost don't. Requests that timed out have no
+// result, the ones pending when the connection was closed have no message.
+void madpostgres__rejectWithResult(PAP_t *badCB, PGresult *res) {
+  if (res == NULL) {
+    __applyPAP__(badCB, 2, PQUV_ERROR_TIMEOUT, (char*)"Query timed out.");
+    return;
+  }
+
+  int err = PQresultErrorField(res, PG_DIAG_SQLSTATE) == NULL ? PQUV_ERROR_BAD_CONNECTION : PQUV_ERROR_BAD_QUERY;
+  char *pqMessage = PQresultErrorMessage(res);
+  if (err == PQUV_ERROR_BAD_CONNECTION && pqMessage[0] == '\0') {
+    pqMessage = (char*)"Connection is already closed.";
+  }
+  size_t length = strlen(pqMessage);
+  char *errMessage = (char*)GC_MALLOC_ATOMIC(length + 1);
+  memcpy(errMessage, pqMessage, length + 1);
+  PQclear(res);
+
+  __applyPAP__(badCB, 2, err, errMessage);
+}
+
+
+void madpostgres__rejectOverloaded(PAP_t *badCB) {
+  __applyPAP__(badCB, 2, PQUV_ERROR_OVERLOADED, (char*)"Too many pending queries on the connection.");
+}
+
+
+// returns the rows of the result, row r being the colCount + 1 nodes starting
+// at rows + r * (colCount + 1)
+madlib__list__Node_t *madpostgres__decodeRows(PGresult *res, madpostgres__DecodePlan_t *plan, madpostgres__DecodeContext_t *ctx) {
+  madlib__list__Node_t *rows = &ctx->nodes[ctx->nodeOffset];
+
+  for (int row = 0; row < ctx->rowCount; row++) {
+    madpostgres__allocList(ctx, ctx->colCount);
+  }
+
+  for (int col = 0; col < ctx->colCount; col++) {
+    plan->decoders[col](res, col, rows, ctx);
+  }
+
+  return rows;
+}
+
+
+// decodes the rows of a successful result, which is released
+madlib__list__Node_t *madpostgres__decodeResult(PGresult *res, madpostgres__DecodePlan_t *plan) {
+  int rowCount = PQntuples(res);
+  int stride = PQnfields(res) + 1;
+  madpostgres__DecodeContext_t ctx;
+  madpostgres__initDecodeContext(&ctx, res, true);
+
+  madlib__list__Node_t *rows = madpostgres__decodeRows(res, plan, &ctx);
+  madlib__list__Node_t *result = madpostgres__allocList(&ctx, rowCount);
+
+  for (int row = 0; row < rowCount; row++) {
+    result[row].value = &rows[row * stride];
+  }
+
+  PQclear(res);
+  return result;
+}
+
+
+// Results with at least that many rows or bytes are decoded on the libuv
+// thread pool instead of the loop, 0 for no threshold. Both are 0 by default.
+int64_t madpostgres__offLoopMinRows = 0;
+int64_t madpostgres__offLoopMinBytes = 0;
+
+
+typedef struct madpostgres__OffLoopDecode {
+  uv_work_t work;
+  madpostgres__Callbacks_t *callbacks;
+  PGresult *res;
+  madpostgres__DecodePlan_t *plan;
+  madlib__list__Node_t *result;
+  pquv_deferred_t deferred;
+  struct madpostgres__OffLoopDecode *prev;
+  struct madpostgres__OffLoopDecode *next;
+} madpostgres__OffLoopDecode_t;
+
+
+// decodes queued or running on the thread pool, only touched from the loop
+madpostgres__OffLoopDecode_t *madpostgres__pendingDecodes = NULL;
+
+
+void madpostgres__setOffLoopDecoding(int64_t minRows, int64_t minBytes) {
+  if ((minRows > 0 || minBytes > 0) && !madpostgres__smallIntsReady) {
+    madpostgres__initSmallInts();
+  }
+  // workers register themselves with the collector, see
+  // madpostgres__registerWorker
+  GC_allow_register_threads();
+
+  madpostgres__offLoopMinRows = minRows < 0 ? 0 : minRows;
+  madpostgres__offLoopMinBytes = minBytes < 0 ? 0 : minBytes;
+}
+
+
+bool madpostgres__decodesOffLoop(PGresult *res) {
+  if (madpostgres__offLoopMinRows > 0 && PQntuples(res) >= madpostgres__offLoopMinRows) {
+    return true;
+  }
+
+  return madpostgres__offLoopMinBytes > 0 && (int64_t)PQresultMemorySize(res) >= madpostgres__offLoopMinBytes;
+}
+
+
+// the Values a worker allocates are only referenced from its stack until it
+// is done, so the collector must know about it before it decodes anything
+bool madpostgres__registerWorker() {
+  static thread_local bool registered = false;
+  if (registered) {
+    return true;
+  }
+
+  struct GC_stack_base base;
+  if (GC_get_stack_base(&base) != GC_SUCCESS) {
+    return false;
+  }
+
+  int err = GC_register_my_thread(&base);
+  registered = err == GC_SUCCESS || err == GC_DUPLICATE;
+  return registered;
+}
+
+
+void madpostgres__decodeOnWorker(uv_work_t *work) {
+  madpostgres__OffLoopDecode_t *decode = (madpostgres__OffLoopDecode_t*)work;
+
+  if (madpostgres__registerWorker()) {
+    decode->result = madpostgres__decodeResult(decode->res, decode->plan);
+  }
+}
+
+
+// back on the loop, a result the worker could not decode is decoded here.
+// The worker did not run when status is UV_ECANCELED.
+void madpostgres__afterDecodeOnWorker(uv_work_t *work, int status) {
+  madpostgres__OffLoopDecode_t *decode = (madpostgres__OffLoopDecode_t*)work;
+  madlib__list__Node_t *result = status == 0 ? decode->result : NULL;
+  madpostgres__Callbacks_t *callbacks = decode->callbacks;
+
+  if (decode->prev != NULL) {
+    decode->prev->next = decode->next;
+  } else {
+    madpostgres__pendingDecodes = decode->next;
+  }
+  if (decode->next != NULL) {
+    decode->next->prev = decode->prev;
+  }
+
+  if (callbacks->cancelled) {
+    if (result == NULL) {
+      PQclear(decode->res);
+    }
+  } else if (result == NULL) {
+    result = madpostgres__decodeResult(decode->res, decode->plan);
+  }
+
+  pquv_deferred_decoded(decode->deferred);
+  GC_FREE(decode);
+
+  if (!callbacks->cancelled) {
+    __applyPAP__(callbacks->goodCB, 1, result);
+  }
+}
+
+
+// the query of a request being decoded is already done, pquv doesn't know
+// about it anymore
+void madpostgres__cancelDecode(void *request) {
+  for (madpostgres__OffLoopDecode_t *decode = madpostgres__pendingDecodes; decode != NULL; decode = decode->next) {
+    if (decode->callbacks == request) {
+      decode->callbacks->cancelled = true;
+      uv_cancel((uv_req_t*)&decode->work);
+      return;
+    }
+  }
+}
+
+
+// The plan is looked up here as the cache is only touched from the loop. The
+// request is uncollectable, it is the only reference to the callbacks and the
+// result while the worker runs.
+bool madpostgres__queueDecode(madpostgres__Callbacks_t *callbacks, PGresult *res) {
+  madpostgres__OffLoopDecode_t *decode =
+    (madpostgres__OffLoopDecode_t*)GC_MALLOC_UNCOLLECTABLE(sizeof(madpostgres__OffLoopDecode_t));
+  decode->callbacks = callbacks;
+  decode->res = res;
+  decode->plan = madpostgres__decodePlan(res);
+  decode->result = NULL;
+
+  if (uv_queue_work(getLoop(), &decode->work, madpostgres__decodeOnWorker, madpostgres__afterDecodeOnWorker) != 0) {
+    GC_FREE(decode);
+    return false;
+  }
+
+  decode->deferred = pquv_result_deferred();
+  decode->prev = NULL;
+  decode->next = madpostgres__pendingDecodes;
+  if (decode->next != NULL) {
+    decode->next->prev = decode;
+  }
+  madpostgres__pendingDecodes = decode;
+  return true;
+}
+
+
+void madpostgres__handleQueryResult(void *callbacks, PGresult* res) {
+  madpostgres__Callbacks_t *typedCallbacks = (madpostgres__Callbacks_t*)callbacks;
+  ExecStatusType status = PQresultStatus(res);
+
+  if (status != PGRES_TUPLES_OK && status != PGRES_COMMAND_OK && status != PGRES_EMPTY_QUERY) {
+    madpostgres__rejectWithResult((PAP_t*)typedCallbacks->badCB, res);
+    return;
+  }
+
+  if (madpostgres__decodesOffLoop(res) && madpostgres__queueDecode(typedCallbacks, res)) {
+    return;
+  }
+
+  madlib__list__Node_t *result = madpostgres__decodeResult(res, madpostgres__decodePlan(res));
+  pquv_result_decoded();
+  __applyPAP__(typedCallbacks->goodCB, 1, result);
+}
+
+
+// results of a multi statement query come one statement at a time, the first
+// failure rejects the query and the results that follow it are dropped
+void madpostgres__handleMultiResult(void *callbacks, PGresult* res) {
+  madpostgres__MultiCallbacks_t *typedCallbacks = (madpostgres__MultiCallbacks_t*)callbacks;
+  ExecStatusType status = PQresultStatus(res);
+
+  if (typedCallbacks->failed) {
+    PQclear(res);
+    return;
+  }
+
+#ifdef LIBPQ_HAS_PIPELINING
+  if (status == PGRES_PIPELINE_SYNC) {
+    PQclear(res);
+
+    madlib__list__Node_t *results = madlib__list__empty();
+    for (madlib__list__Node_t *node = typedCallbacks->results; node->next != NULL; node = node->next) {
+      results = madlib__list__push(node->value, results);
+    }
+
+    pquv_result_decoded();
+    __applyPAP__(typedCallbacks->goodCB, 1, results);
+    return;
+  }
+#endif
+
+  if (status != PGRES_TUPLES_OK && status != PGRES_COMMAND_OK && status != PGRES_EMPTY_QUERY) {
+    typedCallbacks->failed = true;
+    madpostgres__rejectWithResult((PAP_t*)typedCallbacks->badCB, res);
+    return;
+  }
+
+  typedCallbacks->results = madlib__list__push(
+    madpostgres__decodeResult(res, madpostgres__decodePlan(res)),
+    typedCallbacks->results
+  );
+}
+
+
+// hands the buffered rows to the chunk callback, which returns false to stop
+// the stream
+void madpostgres__flushStream(madpostgres__StreamCallbacks_t *callbacks) {
+  madlib__list__Node_t *chunk = madlib__list__empty();
+
+  for (int64_t i = callbacks->bufferedCount - 1; i >= 0; i--) {
+    chunk = madlib__list__push(callbacks->rows[i], chunk);
+    callbacks->rows[i] = NULL;
+  }
+
+  callbacks->deliveredCount += callbacks->bufferedCount;
+  callbacks->bufferedCount = 0;
+
+  bool shouldContinue = (int64_t)__applyPAP__(callbacks->chunkCB, 1, chunk);
+  callbacks->stopped = !shouldContinue;
+}
+
+
+void madpostgres__handleStreamResult(void *callbacks, PGresult* res) {
+  madpostgres__StreamCallbacks_t *typedCallbacks = (madpostgres__StreamCallbacks_t*)callbacks;
+  ExecStatusType status = PQresultStatus(res);
+  bool partial = status == PGRES_SINGLE_TUPLE;
+#ifdef LIBPQ_HAS_CHUNK_MODE
+  partial = partial || status == PGRES_TUPLES_CHUNK;
+#endif
+
+  if (!partial && status != PGRES_TUPLES_OK && status != PGRES_COMMAND_OK && status != PGRES_EMPTY_QUERY) {
+    madpostgres__rejectWithResult((PAP_t*)typedCallbacks->badCB, res);
+    return;
+  }
+
+  int rowCount = PQntuples(res);
+  int stride = PQnfields(res) + 1;
+
+  // all results of the stream share the same columns
+  if (typedCallbacks->plan == NULL && rowCount > 0) {
+    typedCallbacks->plan = madpostgres__decodePlan(res);
+  }
+
+  madlib__list__Node_t *rows = NULL;
+  madpostgres__DecodeContext_t ctx;
+
+  if (rowCount > 0) {
+    madpostgres__initDecodeContext(&ctx, res, false);
+    rows = madpostgres__decodeRows(res, typedCallbacks->plan, &ctx);
+  }
+
+  for (int row = 0; row < rowCount && !typedCallbacks->stopped; row++) {
+    typedCallbacks->rows[typedCallbacks->bufferedCount] = &rows[row * stride];
+    typedCallbacks->bufferedCount += 1;
+
+    if (typedCallbacks->bufferedCount == typedCallbacks->chunkSize) {
+      madpostgres__flushStream(typedCallbacks);
+    }
+  }
+
+  PQclear(res);
+
+  // the rows left are not needed, the query is cancelled and the stream
+  // resolves with the rows handed out so far
+  if (typedCallbacks->stopped) {
+    if (partial) {
+      pquv_cancel(typedCallbacks->connection, callbacks);
+    }
+
+    __applyPAP__(typedCallbacks->goodCB, 1, typedCallbacks->deliveredCount);
+    return;
+  }
+
+  if (!partial) {
+    if (typedCallbacks->bufferedCount > 0) {
+      madpostgres__flushStream(typedCallbacks);
+    }
+
+    __applyPAP__(typedCallbacks->goodCB, 1, typedCallbacks->deliveredCount);
+  }
+}
+
+
+madpostgres__ColumnKind_t madpostgres__columnKind(Oid type) {
+  switch(type) {
+    case INT8OID:
+    case INT4OID:
+    case INT2OID:
+    case TIMESTAMPOID:
+    case TIMESTAMPTZOID:
+    case DATEOID:
+    case MONEYOID:
+      return madpostgres__ColumnKind_Integer;
+
+    case FLOAT8OID:
+    case FLOAT4OID:
+      return madpostgres__ColumnKind_Float;
+
+    case BOOLOID:
+      return madpostgres__ColumnKind_Boolean;
+
+    case TEXTOID:
+    case VARCHAROID:
+    case JSONOID:
+    case JSONBOID:
+      return madpostgres__ColumnKind_Text;
+
+    default:
+      return madpostgres__ColumnKind_NotImplemented;
+  }
+}
+
+
+madpostgres__Column_t *madpostgres__buildColumn(PGresult *res, int col, int rowCount) {
+  madpostgres__Column_t *column = (madpostgres__Column_t*) GC_MALLOC(sizeof(madpostgres__Column_t));
+  Oid type = PQftype(res, col);
+  char *pqName = PQfname(res, col);
+  size_t nameLength = strlen(pqName);
+
+  column->type = type;
+  column->kind = madpostgres__columnKind(type);
+  column->length = rowCount;
+  column->name = (char*)GC_MALLOC_ATOMIC(nameLength + 1);
+  memcpy(column->name, pqName, nameLength + 1);
+  column->nulls = (uint8_t*)GC_MALLOC_ATOMIC((rowCount + 7) / 8);
+  memset(column->nulls, 0, (rowCount + 7) / 8);
+  column->values = NULL;
+  column->offsets = NULL;
+  column->bytes = NULL;
+
+  for (int row = 0; row < rowCount; row++) {
+    if (PQgetisnull(res, row, col)) {
+      column->nulls[row / 8] |= 1 << (row % 8);
+    }
+  }
+
+  switch (column->kind) {
+    // NULL cells are zeroed so that aggregations don't need to check the
+    // bitmap
+    case madpostgres__ColumnKind_Integer:
+    case madpostgres__ColumnKind_Float: {
+      madpostgres__Cell_t *cells = (madpostgres__Cell_t*)GC_MALLOC_ATOMIC(sizeof(madpostgres__Cell_t) * (rowCount > 0 ? rowCount : 1));
+      madpostgres__decodeFixedColumn(res, col, rowCount, cells);
+      column->values = cells;
+      break;
+    }
+
+    case madpostgres__ColumnKind_Boolean: {
+      uint8_t *bools = (uint8_t*)GC_MALLOC_ATOMIC(rowCount > 0 ? rowCount : 1);
+      for (int row = 0; row < rowCount; row++) {
+        bools[row] = !PQgetisnull(res, row, col) && *PQgetvalue(res, row, col) > 0;
+      }
+      column->values = bools;
+      break;
+    }
+
+    case madpostgres__ColumnKind_Text: {
+      // cells are stored back to back, each followed by a '\0' so that they
+      // can be handed to Madlib without a copy
+      size_t skip = type == JSONBOID ? 1 : 0;
+      size_t total = 0;
+      for (int row = 0; row < rowCount; row++) {
+        int length = PQgetlength(res, row, col);
+        total += (length > (int)skip ? length - skip : 0) + 1;
+      }
+
+      column->offsets = (int64_t*)GC_MALLOC_ATOMIC(sizeof(int64_t) * (rowCount + 1));
+      column->bytes = (char*)GC_MALLOC_ATOMIC(total > 0 ? total : 1);
+
+      size_t offset = 0;
+      for (int row = 0; row < rowCount; row++) {
+        int length = PQgetlength(res, row, col);
+        size_t cellLength = length > (int)skip ? length - skip : 0;
+        column->offsets[row] = offset;
+        memcpy(column->bytes + offset, PQgetvalue(res, row, col) + skip, cellLength);
+        column->bytes[offset + cellLength] = '\0';
+        offset += cellLength + 1;
+      }
+      column->offsets[rowCount] = offset;
+      break;
+    }
+
+    default:
+      break;
+  }
+
+  return column;
+}
+
+
+void madpostgres__handleColumnarResult(void *callbacks, PGresult* res) {
+  madpostgres__Callbacks_t *typedCallbacks = (madpostgres__Callbacks_t*)callbacks;
+  ExecStatusType status = PQresultStatus(res);
+
+  if (status != PGRES_TUPLES_OK && status != PGRES_COMMAND_OK && status != PGRES_EMPTY_QUERY) {
+    madpostgres__rejectWithResult((PAP_t*)typedCallbacks->badCB, res);
+    return;
+  }
+
+  int rowCount = PQntuples(res);
+  int colCount = PQnfields(res);
+  madlib__list__Node_t *result = madlib__list__empty();
+
+  for (int col = colCount - 1; col >= 0; col--) {
+    result = madlib__list__push(madpostgres__buildColumn(res, col, rowCount), result);
+  }
+
+  PQclear(res);
+  pquv_result_decoded();
+  __applyPAP__(typedCallbacks->goodCB, 1, result);
+}
+
+
+bool madpostgres__isInColumn(int64_t index, madpostgres__Column_t *column) {
+  return index >= 0 && index < column->length;
+}
+
+
+int64_t madpostgres__columnLength(madpostgres__Column_t *column) {
+  return column->length;
+}
+
+
+char *madpostgres__columnName(madpostgres__Column_t *column) {
+  return column->name;
+}
+
+
+bool madpostgres__isNullAt(int64_t index, madpostgres__Column_t *column) {
+  return !madpostgres__isInColumn(index, column) || (column->nulls[index / 8] & (1 << (index % 8))) != 0;
+}
+
+
+int64_t madpostgres__integerAt(int64_t index, madpostgres__Column_t *column) {
+  if (column->kind != madpostgres__ColumnKind_Integer || !madpostgres__isInColumn(index, column)) {
+    return 0;
+  }
+  return ((int64_t*)column->values)[index];
+}
+
+
+double madpostgres__floatAt(int64_t index, madpostgres__Column_t *column) {
+  if (column->kind != madpostgres__ColumnKind_Float || !madpostgres__isInColumn(index, column)) {
+    return 0;
+  }
+  return ((double*)column->values)[index];
+}
+
+
+bool madpostgres__booleanAt(int64_t index, madpostgres__Column_t *column) {
+  if (column->kind != madpostgres__ColumnKind_Boolean || !madpostgres__isInColumn(index, column)) {
+    return false;
+  }
+  return ((uint8_t*)column->values)[index];
+}
+
+
+char *madpostgres__textAt(int64_t index, madpostgres__Column_t *column) {
+  if (column->kind != madpostgres__ColumnKind_Text || !madpostgres__isInColumn(index, column)) {
+    return (char*)"";
+  }
+  return column->bytes + column->offsets[index];
+}
+
+
+int64_t madpostgres__sumIntegers(madpostgres__Column_t *column) {
+  if (column->kind != madpostgres__ColumnKind_Integer) {
+    return 0;
+  }
+
+  int64_t *ints = (int64_t*)column->values;
+  int64_t sum = 0;
+  for (int64_t i = 0; i < column->length; i++) {
+    sum += ints[i];
+  }
+  return sum;
+}
+
+
+double madpostgres__sumFloats(madpostgres__Column_t *column) {
+  if (column->kind != madpostgres__ColumnKind_Float) {
+    return 0;
+  }
+
+  double *floats = (double*)column->values;
+  double sum = 0;
+  for (int64_t i = 0; i < column->length; i++) {
+    sum += floats[i];
+  }
+  return sum;
+}
+
+
+madpostgres__Value_t *madpostgres__valueAt(int64_t index, madpostgres__Column_t *column) {
+  madpostgres__Value_t *res = (madpostgres__Value_t*) GC_MALLOC(sizeof(madpostgres__Value_t));
+  res->index = madpostgres__Value_NotImplemented;
+
+  if (madpostgres__isNullAt(index, column)) {
+    return res;
+  }
+
+  switch (column->type) {
+    case INT8OID:
+      res->index = madpostgres__Value_Int8;
+      res->data1 = (void*)madpostgres__integerAt(index, column);
+      break;
+
+    case INT4OID:
+      res->index = madpostgres__Value_Int4;
+      res->data1 = (void*)madpostgres__integerAt(index, column);
+      break;
+
+    case INT2OID:
+      res->index = madpostgres__Value_Int2;
+      res->data1 = (void*)madpostgres__integerAt(index, column);
+      break;
+
+    case MONEYOID: {
+      int64_t cents = madpostgres__integerAt(index, column);
+      res->index = madpostgres__Value_Money;
+      res->data1 = (void*) (cents / 100);
+      res->data2 = (void*) (cents - ((cents / 100) * 100));
+      break;
+    }
+
+    case TIMESTAMPOID:
+    case TIMESTAMPTZOID:
+    case DATEOID: {
+      madpostgres__MadlibADT_t *dateTime = (madpostgres__MadlibADT_t*) GC_MALLOC(sizeof(madpostgres__MadlibADT_t));
+      dateTime->index = 0;
+      dateTime->data = (void*)madpostgres__integerAt(index, column);
+      res->index = column->type == DATEOID
+        ? madpostgres__Value_Date
+        : column->type == TIMESTAMPOID ? madpostgres__Value_Timestamp : madpostgres__Value_TimestampTz;
+      res->data1 = (void*)dateTime;
+      break;
+    }
+
+    case FLOAT8OID:
+    case FLOAT4OID:
+      res->index = column->type == FLOAT8OID ? madpostgres__Value_Float8 : madpostgres__Value_Float4;
+      res->data1 = (void*)boxDouble(madpostgres__floatAt(index, column));
+      break;
+
+    case BOOLOID:
+      res->index = madpostgres__Value_Boolean;
+      res->data1 = (void*)(int64_t)madpostgres__booleanAt(index, column);
+      break;
+
+    case TEXTOID:
+    case VARCHAROID:
+    case JSONOID:
+    case JSONBOID:
+      res->index = column->type == TEXTOID
+        ? madpostgres__Value_Text
+        : column->type == VARCHAROID
+          ? madpostgres__Value_VarChar
+          : column->type == JSONOID ? madpostgres__Value_Json : madpostgres__Value_JsonB;
+      res->data1 = (void*)madpostgres__textAt(index, column);
+      break;
+
+    default:
+      break;
+  }
+
+  return res;
+}
+
+
+// calls badCB and returns false if no query can be sent on the connection
+bool madpostgres__checkConnection(pquv_t *connection, PAP_t *badCB) {
+  int err = pquv_get_error(connection);
+  char *errMessage = pquv_get_errorMessage(connection);
+  bool alreadyDisconnected = pquv_get_disconnected(connection);
+  // printf("errMessage: %s\n", errMessage);
+  if (alreadyDisconnected) {
+    // TODO: allocate the string
+    __applyPAP__(badCB, 2, 1, "Connection is already closed.");
+    return false;
+  }
+  else if (err) {
+    if (err == 1 && !alreadyDisconnected) {
+      // if connection is bad we close it
+      madpostgres__disconnect(connection);
+    }
+    __applyPAP__(badCB, 2, err, errMessage);
+    return false;
+  }
+
+  return true;
+}
+
+
+madpostgres__Callbacks_t *madpostgres__buildCallbacks(pquv_t *connection, PAP_t *badCB, PAP_t *goodCB) {
+  madpostgres__Callbacks_t *callbacks = (madpostgres__Callbacks_t*) GC_MALLOC(sizeof(madpostgres__Callbacks_t));
+  callbacks->badCB = badCB;
+  callbacks->goodCB = goodCB;
+  callbacks->connection = connection;
+  callbacks->settled = false;
+  callbacks->cancelled = false;
+  return callbacks;
+}
+
+
+// request is what the query functions return, NULL when the query was
+// rejected right away
+void madpostgres__cancel(pquv_t *connection, void *request) {
+  if (request != NULL) {
+    pquv_cancel(connection, request);
+    madpostgres__cancelDecode(request);
+  }
+}
+
+
+// Madlib Integers are 64 bits wide, the limits of pquv are ints and treat
+// negative values as 0
+int madpostgres__clampToInt(int64_t n) {
+  if (n > INT_MAX) {
+    return INT_MAX;
+  } else if (n < 0) {
+    return 0;
+  }
+  return (int)n;
+}
+
+
+void madpostgres__setQueueLimits(int64_t maxQueueLength, int64_t maxPendingBytes, pquv_t *connection) {
+  pquv_set_queue_limits(connection, madpostgres__clampToInt(maxQueueLength), maxPendingBytes < 0 ? 0 : maxPendingBytes);
+}
+
+
+void madpostgres__setStatementCacheSize(int64_t size, pquv_t *connection) {
+  pquv_set_statement_cache_size(connection, madpostgres__clampToInt(size));
+}
+
+
+void madpostgres__setPoolQueueLimits(int64_t maxQueueLength, int64_t maxPendingBytes, pquv_pool_t *pool) {
+  pquv_pool_set_queue_limits(pool, madpostgres__clampToInt(maxQueueLength), maxPendingBytes < 0 ? 0 : maxPendingBytes);
+}
+
+
+int64_t madpostgres__pendingQueries(pquv_t *connection) {
+  return pquv_get_pending(connection);
+}
+
+
+int64_t madpostgres__poolPendingQueries(pquv_pool_t *pool) {
+  return pquv_pool_get_pending(pool);
+}
+
+
+pquv_stats_t *madpostgres__stats(pquv_t *connection) {
+  pquv_stats_t *stats = (pquv_stats_t*)GC_MALLOC_ATOMIC(sizeof(pquv_stats_t));
+  pquv_get_stats(connection, stats);
+  return stats;
+}
+
+
+pquv_stats_t *madpostgres__poolStats(pquv_pool_t *pool) {
+  pquv_stats_t *stats = (pquv_stats_t*)GC_MALLOC_ATOMIC(sizeof(pquv_stats_t));
+  pquv_pool_get_stats(pool, stats);
+  return stats;
+}
+
+
+// counter follows the constructors of Counter in Main.mad
+int64_t madpostgres__statsCounter(int64_t counter, pquv_stats_t *stats) {
+  switch (counter) {
+    case 0:
+      return stats->bytesSent;
+    case 1:
+      return stats->errors;
+    case 2:
+      return stats->queries;
+    case 3:
+      return stats->reconnects;
+    case 4:
+      return stats->rejected;
+    case 5:
+      return stats->rows;
+    case 6:
+      return stats->timeouts;
+    default:
+      return 0;
+  }
+}
+
+
+// stage follows the constructors of Stage in Main.mad
+histogram_t *madpostgres__statsHistogram(int64_t stage, pquv_stats_t *stats) {
+  switch (stage) {
+    case 0:
+      return &stats->decode;
+    case 1:
+      return &stats->queued;
+    case 2:
+      return &stats->server;
+    case 3:
+      return &stats->total;
+    default:
+      return &stats->transfer;
+  }
+}
+
+
+int64_t madpostgres__statsPercentile(int64_t stage, double percentile, pquv_stats_t *stats) {
+  return histogram_percentile(madpostgres__statsHistogram(stage, stats), percentile);
+}
+
+
+int64_t madpostgres__statsCount(int64_t stage, pquv_stats_t *stats) {
+  return madpostgres__statsHistogram(stage, stats)->count;
+}
+
+
+int64_t madpostgres__statsSum(int64_t stage, pquv_stats_t *stats) {
+  return madpostgres__statsHistogram(stage, stats)->sum;
+}
+
+
+void madpostgres__setTimeouts(int64_t queueTimeoutMs, int64_t execTimeoutMs, pquv_t *connection) {
+  pquv_set_timeouts(connection, madpostgres__clampToInt(queueTimeoutMs), madpostgres__clampToInt(execTimeoutMs));
+}
+
+
+void madpostgres__setPoolTimeouts(int64_t queueTimeoutMs, int64_t execTimeoutMs, pquv_pool_t *pool) {
+  pquv_pool_set_timeouts(pool, madpostgres__clampToInt(queueTimeoutMs), madpostgres__clampToInt(execTimeoutMs));
+}
+
+
+void madpostgres__cancelPoolQuery(pquv_pool_t *pool, void *request) {
+  if (request != NULL) {
+    pquv_pool_cancel(pool, request);
+    madpostgres__cancelDecode(request);
+  }
+}
+
+
+void *madpostgres__query(pquv_t *connection, char *query, PAP_t *badCB, PAP_t *goodCB) {
+  if (madpostgres__checkConnection(connection, badCB)) {
+    madpostgres__Callbacks_t *callbacks = madpostgres__buildCallbacks(connection, badCB, goodCB);
+    int err = pquv_query_params(
+      connection,
+      query,
+      0,
+      NULL,
+      NULL,
+      NULL,
+      NULL,
+      madpostgres__handleQueryResult,
+      (void*)callbacks,
+      PQUV_NON_VOLATILE_QUERY_STRING
+    );
+
+    if (err != PQUV_ERROR_NONE) {
+      madpostgres__rejectOverloaded(badCB);
+      return NULL;
+    }
+
+    return callbacks;
+  }
+
+  return NULL;
+}
+
+
+void *madpostgres__queryWith(pquv_t *connection, char *query, madlib__list__Node_t *values, PAP_t *badCB, PAP_t *goodCB) {
+  if (madpostgres__checkConnection(connection, badCB)) {
+    madpostgres__Callbacks_t *callbacks = madpostgres__buildCallbacks(connection, badCB, goodCB);
+    madpostgres__Params_t *params = madpostgres__encodeParams(values);
+    int err = pquv_query_params(
+      connection,
+      query,
+      params->count,
+      params->types,
+      params->values,
+      params->lengths,
+      params->formats,
+      madpostgres__handleQueryResult,
+      (void*)callbacks,
+      PQUV_CACHE_STATEMENT | PQUV_NON_VOLATILE_QUERY_STRING
+    );
+
+    if (err != PQUV_ERROR_NONE) {
+      madpostgres__rejectOverloaded(badCB);
+      return NULL;
+    }
+
+    return callbacks;
+  }
+
+  return NULL;
+}
+
+
+void *madpostgres__queryStream(
+  pquv_t *connection,
+  char *query,
+  int64_t chunkSize,
+  PAP_t *chunkCB,
+  PAP_t *badCB,
+  PAP_t *goodCB
+) {
+  if (madpostgres__checkConnection(connection, badCB)) {
+    if (chunkSize < 1) {
+      chunkSize = 1;
+    }
+
+    madpostgres__StreamCallbacks_t *callbacks =
+      (madpostgres__StreamCallbacks_t*) GC_MALLOC(sizeof(madpostgres__StreamCallbacks_t));
+    callbacks->badCB = badCB;
+    callbacks->goodCB = goodCB;
+    callbacks->chunkCB = chunkCB;
+    callbacks->connection = connection;
+    callbacks->plan = NULL;
+    callbacks->chunkSize = chunkSize;
+    callbacks->rows = (void**) GC_MALLOC(sizeof(void*) * chunkSize);
+    callbacks->bufferedCount = 0;
+    callbacks->deliveredCount = 0;
+    callbacks->stopped = false;
+
+    int err = pquv_query_stream(
+      connection,
+      query,
+      0,
+      NULL,
+      NULL,
+      NULL,
+      NULL,
+      chunkSize,
+      madpostgres__handleStreamResult,
+      (void*)callbacks,
+      PQUV_NON_VOLATILE_QUERY_STRING
+    );
+
+    if (err != PQUV_ERROR_NONE) {
+      madpostgres__rejectOverloaded(badCB);
+      return NULL;
+    }
+
+    return callbacks;
+  }
+
+  return NULL;
+}
+
+
+void *madpostgres__queryColumnar(pquv_t *connection, char *query, PAP_t *badCB, PAP_t *goodCB) {
+  if (madpostgres__checkConnection(connection, badCB)) {
+    madpostgres__Callbacks_t *callbacks = madpostgres__buildCallbacks(connection, badCB, goodCB);
+    int err = pquv_query_params(
+      connection,
+      query,
+      0,
+      NULL,
+      NULL,
+      NULL,
+      NULL,
+      madpostgres__handleColumnarResult,
+      (void*)callbacks,
+      PQUV_NON_VOLATILE_QUERY_STRING
+    );
+
+    if (err != PQUV_ERROR_NONE) {
+      madpostgres__rejectOverloaded(badCB);
+      return NULL;
+    }
+
+    return callbacks;
+  }
+
+  return NULL;
+}
+
+
+void *madpostgres__queryMulti(pquv_t *connection, char *query, PAP_t *badCB, PAP_t *goodCB) {
+  if (madpostgres__checkConnection(connection, badCB)) {
+    madpostgres__MultiCallbacks_t *callbacks =
+      (madpostgres__MultiCallbacks_t*) GC_MALLOC(sizeof(madpostgres__MultiCallbacks_t));
+    callbacks->badCB = badCB;
+    callbacks->goodCB = goodCB;
+    callbacks->connection = connection;
+    callbacks->results = madlib__list__empty();
+    callbacks->failed = false;
+
+    int err = pquv_query_multi(
+      connection,
+      query,
+      madpostgres__handleMultiResult,
+      (void*)callbacks,
+      PQUV_NON_VOLATILE_QUERY_STRING
+    );
+
+    if (err != PQUV_ERROR_NONE) {
+      madpostgres__rejectOverloaded(badCB);
+      return NULL;
+    }
+
+    return callbacks;
+  }
+
+  return NULL;
+}
+
+
+void madpostgres__handleCopyInResult(void *callbacks, PGresult* res) {
+  madpostgres__CopyInCallbacks_t *typedCallbacks = (madpostgres__CopyInCallbacks_t*)callbacks;
+
+  if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+    madpostgres__rejectWithResult((PAP_t*)typedCallbacks->badCB, res);
+    return;
+  }
+
+  int64_t rowCount = strtoll(PQcmdTuples(res), NULL, 10);
+  PQclear(res);
+  __applyPAP__(typedCallbacks->goodCB, 1, rowCount);
+}
+
+
+void *madpostgres__copyIn(pquv_t *connection, char *target, madlib__list__Node_t *rows, PAP_t *badCB, PAP_t *goodCB) {
+  if (madpostgres__checkConnection(connection, badCB)) {
+    madpostgres__CopyInCallbacks_t *callbacks =
+      (madpostgres__CopyInCallbacks_t*) GC_MALLOC(sizeof(madpostgres__CopyInCallbacks_t));
+    callbacks->badCB = badCB;
+    callbacks->goodCB = goodCB;
+    callbacks->connection = connection;
+    callbacks->rows = rows;
+    callbacks->capacity = MADPOSTGRES_COPY_CHUNK_SIZE;
+    callbacks->buffer = (char*)GC_MALLOC_ATOMIC(callbacks->capacity);
+    callbacks->headerSent = false;
+    callbacks->trailerSent = false;
+
+    const char *prefix = "COPY ";
+    const char *suffix = " FROM STDIN (FORMAT binary)";
+    size_t length = strlen(prefix) + strlen(target) + strlen(suffix);
+    char *query = (char*)GC_MALLOC_ATOMIC(length + 1);
+    snprintf(query, length + 1, "%s%s%s", prefix, target, suffix);
+
+    int err = pquv_copy_in(
+      connection,
+      query,
+      madpostgres__produceCopyData,
+      madpostgres__handleCopyInResult,
+      (void*)callbacks,
+      PQUV_NON_VOLATILE_QUERY_STRING
+    );
+
+    if (err != PQUV_ERROR_NONE) {
+      madpostgres__rejectOverloaded(badCB);
+      return NULL;
+    }
+
+    return callbacks;
+  }
+
+  return NULL;
+}
+
+
+// the buffer is handed over to Madlib, the next chunk gets a new one
+void madpostgres__flushCopyOut(madpostgres__CopyOutCallbacks_t *callbacks) {
+  madlib__bytearray__ByteArray_t *chunk =
+    (madlib__bytearray__ByteArray_t*) GC_MALLOC(sizeof(madlib__bytearray__ByteArray_t));
+  chunk->bytes = callbacks->buffer;
+  chunk->length = callbacks->length;
+  chunk->capacity = callbacks->capacity;
+
+  callbacks->buffer = NULL;
+  callbacks->length = 0;
+
+  __applyPAP__(callbacks->sinkCB, 1, chunk);
+}
+
+
+void madpostgres__receiveCopyData(void *callbacks, const char *buf, int length) {
+  madpostgres__CopyOutCallbacks_t *typedCallbacks = (madpostgres__CopyOutCallbacks_t*)callbacks;
+
+  if (typedCallbacks->length + length > typedCallbacks->capacity && typedCallbacks->length > 0) {
+    madpostgres__flushCopyOut(typedCallbacks);
+  }
+
+  if (typedCallbacks->buffer == NULL) {
+    // a single row larger than a chunk gets a chunk of its own
+    typedCallbacks->capacity = length > MADPOSTGRES_COPY_CHUNK_SIZE ? length : MADPOSTGRES_COPY_CHUNK_SIZE;
+    typedCallbacks->buffer = (unsigned char*)GC_MALLOC_ATOMIC(typedCallbacks->capacity);
+  }
+
+  memcpy(typedCallbacks->buffer + typedCallbacks->length, buf, length);
+  typedCallbacks->length += length;
+}
+
+
+void madpostgres__handleCopyOutResult(void *callbacks, PGresult* res) {
+  madpostgres__CopyOutCallbacks_t *typedCallbacks = (madpostgres__CopyOutCallbacks_t*)callbacks;
+
+  if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+    madpostgres__rejectWithResult((PAP_t*)typedCallbacks->badCB, res);
+    return;
+  }
+
+  if (typedCallbacks->length > 0) {
+    madpostgres__flushCopyOut(typedCallbacks);
+  }
+
+  int64_t rowCount = strtoll(PQcmdTuples(res), NULL, 10);
+  PQclear(res);
+  __applyPAP__(typedCallbacks->goodCB, 1, rowCount);
+}
+
+
+void *madpostgres__copyOut(pquv_t *connection, char *query, PAP_t *sinkCB, PAP_t *badCB, PAP_t *goodCB) {
+  if (madpostgres__checkConnection(connection, badCB)) {
+    madpostgres__CopyOutCallbacks_t *callbacks =
+      (madpostgres__CopyOutCallbacks_t*) GC_MALLOC(sizeof(madpostgres__CopyOutCallbacks_t));
+    callbacks->badCB = badCB;
+    callbacks->goodCB = goodCB;
+    callbacks->sinkCB = sinkCB;
+    callbacks->connection = connection;
+    callbacks->capacity = 0;
+    callbacks->buffer = NULL;
+    callbacks->length = 0;
+
+    int err = pquv_copy_out(
+      connection,
+      query,
+      madpostgres__receiveCopyData,
+      madpostgres__handleCopyOutResult,
+      (void*)callbacks,
+      PQUV_NON_VOLATILE_QUERY_STRING
+    );
+
+    if (err != PQUV_ERROR_NONE) {
+      madpostgres__rejectOverloaded(badCB);
+      return NULL;
+    }
+
+    return callbacks;
+  }
+
+  return NULL;
+}
+
+
+void madpostgres__handlePoolConnection(void *callbacks, pquv_pool_t* pool) {
+  madpostgres__Callbacks_t *typedCallbacks = (madpostgres__Callbacks_t*)callbacks;
+  int err = pquv_pool_get_error(pool);
+
+  if (typedCallbacks->settled) {
+    return;
+  }
+  typedCallbacks->settled = true;
+
+  if (err > 0) {
+    char *errMessage = pquv_pool_get_errorMessage(pool);
+    pquv_pool_free(pool);
+    __applyPAP__(typedCallbacks->badCB, 2, err, errMessage);
+  } else {
+    __applyPAP__(typedCallbacks->goodCB, 1, pool);
+  }
+}
+
+
+void *madpostgres__connectPool(int64_t minSize, int64_t maxSize, char *connectionString, PAP_t *badCB, PAP_t *goodCB) {
+  madpostgres__Callbacks_t *callbacks = (madpostgres__Callbacks_t*) GC_MALLOC(sizeof(madpostgres__Callbacks_t));
+  callbacks->badCB = badCB;
+  callbacks->goodCB = goodCB;
+  callbacks->connection = NULL;
+  callbacks->settled = false;
+  callbacks->cancelled = false;
+  callbacks->pool = pquv_pool_init(
+    connectionString,
+    getLoop(),
+    madpostgres__clampToInt(minSize),
+    madpostgres__clampToInt(maxSize),
+    PQUV_POOL_DEFAULT_IDLE_TIMEOUT_MS,
+    callbacks,
+    madpostgres__handlePoolConnection
+  );
+  return callbacks;
+}
+
+
+// closes a pool whose first connection is still being established, neither
+// callback is called then
+void madpostgres__cancelConnectPool(void *request) {
+  madpostgres__Callbacks_t *callbacks = (madpostgres__Callbacks_t*)request;
+
+  if (!callbacks->settled) {
+    callbacks->settled = true;
+    pquv_pool_free(callbacks->pool);
+  }
+}
+
+
+void madpostgres__disconnectPool(pquv_pool_t *pool) {
+  pquv_pool_free(pool);
+}
+
+
+void *madpostgres__poolQuery(pquv_pool_t *pool, char *query, PAP_t *badCB, PAP_t *goodCB) {
+  if (pquv_pool_get_disconnected(pool)) {
+    __applyPAP__(badCB, 2, 1, "Pool is already closed.");
+  } else {
+    madpostgres__Callbacks_t *callbacks = (madpostgres__Callbacks_t*) GC_MALLOC(sizeof(madpostgres__Callbacks_t));
+    callbacks->badCB = badCB;
+    callbacks->goodCB = goodCB;
+    callbacks->connection = NULL;
+    callbacks->cancelled = false;
+    int err = pquv_pool_query_params(
+      pool,
+      query,
+      0,
+      NULL,
+      NULL,
+      NULL,
+      NULL,
+      madpostgres__handleQueryResult,
+      (void*)callbacks,
+      PQUV_NON_VOLATILE_QUERY_STRING
+    );
+
+    if (err == PQUV_ERROR_BAD_CONNECTION) {
+      // no connection could be opened, the last connection error says why
+      char *errMessage = pquv_pool_get_errorMessage(pool);
+      if (strcmp(errMessage, "") == 0) {
+        errMessage = (char*)"Connection failed.";
+      }
+      __applyPAP__(badCB, 2, err, errMessage);
+      return NULL;
+    } else if (err != PQUV_ERROR_NONE) {
+      madpostgres__rejectOverloaded(badCB);
+      return NULL;
+    }
+
+    return callbacks;
+  }
+
+  return NULL;
 }
 
 
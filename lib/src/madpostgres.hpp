@@ -1,4 +1,5 @@
 #include "pquv.hpp"
+#include "pquvpool.hpp"
 
 #ifdef __cplusplus
 extern "C" {
@@ -6,21 +7,27 @@ extern "C" {
 
 // https://manpages.ubuntu.com/manpages/jammy/man3/pqt-specs.3.html
 
-const int64_t madpostgres__Value_Boolean = 0;
-const int64_t madpostgres__Value_Date = 1;
-const int64_t madpostgres__Value_Float4 = 2;
-const int64_t madpostgres__Value_Float8 = 3;
-const int64_t madpostgres__Value_Int2 = 4;
-const int64_t madpostgres__Value_Int4 = 5;
-const int64_t madpostgres__Value_Int8 = 6;
-const int64_t madpostgres__Value_Json = 7;
-const int64_t madpostgres__Value_JsonB = 8;
-const int64_t madpostgres__Value_Money = 9;
-const int64_t madpostgres__Value_NotImplemented = 10;
-const int64_t madpostgres__Value_Text = 11;
-const int64_t madpostgres__Value_Timestamp = 12;
-const int64_t madpostgres__Value_TimestampTz = 13;
-const int64_t madpostgres__Value_VarChar = 14;
+const int64_t madpostgres__Value_Array = 0;
+const int64_t madpostgres__Value_Boolean = 1;
+const int64_t madpostgres__Value_ByteA = 2;
+const int64_t madpostgres__Value_Date = 3;
+const int64_t madpostgres__Value_Float4 = 4;
+const int64_t madpostgres__Value_Float8 = 5;
+const int64_t madpostgres__Value_Inet = 6;
+const int64_t madpostgres__Value_Int2 = 7;
+const int64_t madpostgres__Value_Int4 = 8;
+const int64_t madpostgres__Value_Int8 = 9;
+const int64_t madpostgres__Value_Json = 10;
+const int64_t madpostgres__Value_JsonB = 11;
+const int64_t madpostgres__Value_Money = 12;
+const int64_t madpostgres__Value_NotImplemented = 13;
+const int64_t madpostgres__Value_Numeric = 14;
+const int64_t madpostgres__Value_NumericText = 15;
+const int64_t madpostgres__Value_Text = 16;
+const int64_t madpostgres__Value_Timestamp = 17;
+const int64_t madpostgres__Value_TimestampTz = 18;
+const int64_t madpostgres__Value_Uuid = 19;
+const int64_t madpostgres__Value_VarChar = 20;
 
 typedef struct madpostgres__MadlibADT {
   int64_t index;
@@ -33,11 +40,161 @@ typedef struct madpostgres__Value {
   void *data2;
 } madpostgres__Value_t;
 
-typedef madpostgres__Value_t* (*madpostgres__ValueParser)(char* pqValue);
+// dimensions of an array, as limited by postgres
+#define MADPOSTGRES_ARRAY_MAX_DIMS 6
 
-void madpostgres__connect(char *connectionString, PAP_t *badCB, PAP_t *goodCB);
+#define MADPOSTGRES_SMALL_INT_MIN -128
+#define MADPOSTGRES_SMALL_INT_MAX 1024
+
+// distinct strings interned per column
+#define MADPOSTGRES_INTERN_CAPACITY 64
+#define MADPOSTGRES_INTERN_SLOTS 128
+#define MADPOSTGRES_INTERN_MAX_LENGTH 64
+#define MADPOSTGRES_INTERN_MIN_ROWS 16
+
+typedef struct madpostgres__InternTable {
+  bool disabled;
+  int count;
+  uint32_t hashes[MADPOSTGRES_INTERN_SLOTS];
+  int lengths[MADPOSTGRES_INTERN_SLOTS];
+  madpostgres__Value_t *values[MADPOSTGRES_INTERN_SLOTS];
+} madpostgres__InternTable_t;
+
+// a fixed width cell in host order
+typedef union madpostgres__Cell {
+  int64_t i;
+  double f;
+} madpostgres__Cell_t;
+
+// arenas shared by the cells decoded from one PGresult, see
+// madpostgres__initDecodeContext
+typedef struct madpostgres__DecodeContext {
+  // text cells, each '\0' terminated
+  char *slab;
+  size_t slabOffset;
+  madpostgres__Value_t *values;
+  size_t valueOffset;
+  madpostgres__MadlibADT_t *dateTimes;
+  size_t dateTimeOffset;
+  double *floats;
+  size_t floatOffset;
+  madlib__list__Node_t *nodes;
+  size_t nodeOffset;
+  // bytea and inet cells, see madpostgres__copyBytes
+  madlib__bytearray__ByteArray_t *byteArrays;
+  size_t byteArrayOffset;
+  // fixed width columns decoded up front, NULL for the other columns
+  madpostgres__Cell_t **cells;
+  int rowCount;
+  int colCount;
+  // position of the cell being decoded
+  int row;
+  int col;
+  // one table per column, NULL when interning is off for the result
+  madpostgres__InternTable_t **interns;
+} madpostgres__DecodeContext_t;
+
+typedef madpostgres__Value_t* (*madpostgres__ValueParser)(char* pqValue, int length, madpostgres__DecodeContext_t *ctx);
+
+// decodes the cells of column col in the nodes of every row, see
+// madpostgres__decodeRows
+typedef void (*madpostgres__ColumnDecoder)(
+  PGresult *res,
+  int col,
+  madlib__list__Node_t *rows,
+  madpostgres__DecodeContext_t *ctx
+);
+
+#define MADPOSTGRES_PLAN_CACHE_SIZE 64
+
+// the column decoders of a result shape, keyed by the types of its columns
+typedef struct madpostgres__DecodePlan {
+  int colCount;
+  Oid *types;
+  madpostgres__ColumnDecoder *decoders;
+} madpostgres__DecodePlan_t;
+
+// how the cells of a column are laid out in its values array
+typedef enum madpostgres__ColumnKind {
+  // int64_t, also used for money in cents and for dates and timestamps in ms
+  madpostgres__ColumnKind_Integer = 0,
+  // double
+  madpostgres__ColumnKind_Float,
+  // uint8_t
+  madpostgres__ColumnKind_Boolean,
+  // bytes and offsets, values is unused
+  madpostgres__ColumnKind_Text,
+  madpostgres__ColumnKind_NotImplemented,
+} madpostgres__ColumnKind_t;
+
+// one column of a result, cells are stored in dense arrays instead of boxed
+// Values. The bit row % 8 of nulls[row / 8] is set when the cell is NULL.
+typedef struct madpostgres__Column {
+  Oid type;
+  madpostgres__ColumnKind_t kind;
+  char *name;
+  int64_t length;
+  uint8_t *nulls;
+  void *values;
+  // text cell i starts at bytes + offsets[i] and is '\0' terminated
+  int64_t *offsets;
+  char *bytes;
+} madpostgres__Column_t;
+
+// query parameters in binary format, values point into buffer
+typedef struct madpostgres__Params {
+  int count;
+  char *buffer;
+  Oid *types;
+  char **values;
+  int *lengths;
+  int *formats;
+} madpostgres__Params_t;
+
+// connect and the query functions return a request to cancel, see
+// madpostgres__cancelConnect and madpostgres__cancel
+void *madpostgres__connect(char *connectionString, PAP_t *badCB, PAP_t *goodCB);
+void madpostgres__cancelConnect(void *request);
 void madpostgres__disconnect(pquv_t *connection);
-void madpostgres__query(pquv_t *connection, char *query, PAP_t *badCB, PAP_t *goodCB);
+void *madpostgres__query(pquv_t *connection, char *query, PAP_t *badCB, PAP_t *goodCB);
+void *madpostgres__copyIn(pquv_t *connection, char *target, madlib__list__Node_t *rows, PAP_t *badCB, PAP_t *goodCB);
+void *madpostgres__copyOut(pquv_t *connection, char *query, PAP_t *sinkCB, PAP_t *badCB, PAP_t *goodCB);
+void *madpostgres__queryStream(pquv_t *connection, char *query, int64_t chunkSize, PAP_t *chunkCB, PAP_t *badCB, PAP_t *goodCB);
+void *madpostgres__queryWith(pquv_t *connection, char *query, madlib__list__Node_t *values, PAP_t *badCB, PAP_t *goodCB);
+void *madpostgres__queryMulti(pquv_t *connection, char *query, PAP_t *badCB, PAP_t *goodCB);
+void *madpostgres__queryColumnar(pquv_t *connection, char *query, PAP_t *badCB, PAP_t *goodCB);
+void madpostgres__cancel(pquv_t *connection, void *request);
+void madpostgres__setTimeouts(int64_t queueTimeoutMs, int64_t execTimeoutMs, pquv_t *connection);
+void madpostgres__setQueueLimits(int64_t maxQueueLength, int64_t maxPendingBytes, pquv_t *connection);
+void madpostgres__setStatementCacheSize(int64_t size, pquv_t *connection);
+pquv_stats_t *madpostgres__stats(pquv_t *connection);
+pquv_stats_t *madpostgres__poolStats(pquv_pool_t *pool);
+int64_t madpostgres__statsCounter(int64_t counter, pquv_stats_t *stats);
+int64_t madpostgres__statsPercentile(int64_t stage, double percentile, pquv_stats_t *stats);
+int64_t madpostgres__statsCount(int64_t stage, pquv_stats_t *stats);
+int64_t madpostgres__statsSum(int64_t stage, pquv_stats_t *stats);
+int64_t madpostgres__pendingQueries(pquv_t *connection);
+void madpostgres__setOffLoopDecoding(int64_t minRows, int64_t minBytes);
+
+int64_t madpostgres__columnLength(madpostgres__Column_t *column);
+char *madpostgres__columnName(madpostgres__Column_t *column);
+bool madpostgres__isNullAt(int64_t index, madpostgres__Column_t *column);
+int64_t madpostgres__integerAt(int64_t index, madpostgres__Column_t *column);
+double madpostgres__floatAt(int64_t index, madpostgres__Column_t *column);
+bool madpostgres__booleanAt(int64_t index, madpostgres__Column_t *column);
+char *madpostgres__textAt(int64_t index, madpostgres__Column_t *column);
+madpostgres__Value_t *madpostgres__valueAt(int64_t index, madpostgres__Column_t *column);
+int64_t madpostgres__sumIntegers(madpostgres__Column_t *column);
+double madpostgres__sumFloats(madpostgres__Column_t *column);
+
+void *madpostgres__connectPool(int64_t minSize, int64_t maxSize, char *connectionString, PAP_t *badCB, PAP_t *goodCB);
+void madpostgres__cancelConnectPool(void *request);
+void madpostgres__disconnectPool(pquv_pool_t *pool);
+void *madpostgres__poolQuery(pquv_pool_t *pool, char *query, PAP_t *badCB, PAP_t *goodCB);
+void madpostgres__cancelPoolQuery(pquv_pool_t *pool, void *request);
+void madpostgres__setPoolTimeouts(int64_t queueTimeoutMs, int64_t execTimeoutMs, pquv_pool_t *pool);
+void madpostgres__setPoolQueueLimits(int64_t maxQueueLength, int64_t maxPendingBytes, pquv_pool_t *pool);
+int64_t madpostgres__poolPendingQueries(pquv_pool_t *pool);
 
 #ifdef __cplusplus
 }
@@ -1,5 +1,7 @@
 #include "pquv.hpp"
 
+#include <ctype.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <string.h>
 #include <unistd.h>
@@ -15,8 +17,56 @@ enum pquv_req_kind_t {
   PQUV_NORMAL_STATEMENT = 0,
   PQUV_PREPARE_STATEMENT,
   PQUV_PREPARED_STATEMENT,
+  PQUV_COPY_IN,
+  PQUV_COPY_OUT,
+  PQUV_MULTI_STATEMENT,
 };
 
+/* how much of a request reached libpq, see `send_req` */
+enum pquv_send_t {
+  PQUV_SENT = 0,
+  PQUV_NOT_SENT,
+  PQUV_PARTLY_SENT,
+};
+
+enum pquv_copy_state_t {
+  PQUV_COPY_NONE = 0,
+  PQUV_COPY_STREAMING,
+  PQUV_COPY_ENDING,
+  PQUV_COPY_RECEIVING,
+  PQUV_COPY_DONE,
+};
+
+/* a statement prepared on the connection, kept in a hash table for lookups
+ * by query text and parameter types, and in a list ordered from the most to
+ * the least recently used */
+typedef struct stmt_ts {
+  const char* q;
+  int nParams;
+  const Oid* paramTypes;
+  uint64_t hash;
+  char name[24];
+  bool cached;
+  struct stmt_ts* bucketNext;
+  struct stmt_ts* prev;
+  struct stmt_ts* next;
+} stmt_t;
+
+#define STMT_CACHE_BUCKETS 512
+
+typedef struct {
+  stmt_t* buckets[STMT_CACHE_BUCKETS];
+  stmt_t* head;
+  stmt_t* tail;
+  int length;
+  int capacity;
+} stmt_cache_t;
+
+/* requests with up to that many parameters keep them in the request itself */
+#define REQ_INLINE_PARAMS 8
+/* freed requests kept by a connection for the next ones */
+#define REQ_FREE_LIST_LENGTH 128
+
 typedef struct req_ts {
   int kind;
   const char* q;
@@ -29,12 +79,58 @@ typedef struct req_ts {
   uint32_t flags;
   void* opaque;
   req_cb cb;
+  bool delivered;
+  /* statement the request executes when it goes through the cache */
+  stmt_t* stmt;
+  /* results of internal commands sent ahead of the request itself */
+  int skipResults;
+  /* rows per result for `PQUV_SINGLE_ROW` requests when libpq supports
+   * chunked rows, and whether the row mode can still be changed */
+  int chunkSize;
+  bool rowModeSet;
+  /* data source of `PQUV_COPY_IN` requests, and the chunk libpq could not
+   * take yet */
+  copy_in_cb copyCB;
+  /* data sink of `PQUV_COPY_OUT` requests */
+  copy_out_cb copyOutCB;
+  enum pquv_copy_state_t copyState;
+  const char* copyBuf;
+  int copyPending;
+  bool copyFailed;
+  /* loop times past which the request fails with a NULL result, 0 for none:
+   * while queued, then once sent */
+  uint64_t queueDeadline;
+  uint64_t execDeadline;
+  uint64_t execTimeoutMs;
+  /* timed out while requests were pipelined behind it, it is cancelled once
+   * they are gone and nothing new is sent until then */
+  bool cancelOnceAlone;
+  /* whether the request executed a statement prepared by an earlier one */
+  bool stmtReused;
+  /* error of a reused statement that went stale, held back until the sync
+   * point tells whether the request can be sent again, which happens once */
+  PGresult* staleRes;
+  bool resent;
+  /* size of the query and parameters, counted in the budget of the
+   * connection until the request is freed */
+  size_t bytes;
+  /* uv_hrtime of the stages of the request, 0 until reached, see
+   * `pquv_stats_t`. The first result is stamped on the first bytes read
+   * while the request is the oldest in flight. */
+  uint64_t queuedAt;
+  uint64_t sentAt;
+  uint64_t firstResultAt;
+  Oid inlineTypes[REQ_INLINE_PARAMS];
+  const char* inlineValues[REQ_INLINE_PARAMS];
+  int inlineLengths[REQ_INLINE_PARAMS];
+  int inlineFormats[REQ_INLINE_PARAMS];
   struct req_ts* next;
 } req_t;
 
 typedef struct {
   req_t* head;
   req_t* tail;
+  int length;
 } queue_t;
 
 enum pquv_state_t {
@@ -46,12 +142,6 @@ enum pquv_state_t {
   PQUV_BAD_RESET,
 };
 
-enum pquv_error_t {
-  PQUV_ERROR_NONE = 0,
-  PQUV_ERROR_BAD_CONNECTION,
-  PQUV_ERROR_BAD_QUERY,
-};
-
 struct pquv_st {
   uv_loop_t* loop;
   uv_poll_t poll;
@@ -60,8 +150,12 @@ struct pquv_st {
   enum pquv_state_t state;
   char* conninfo;
   PGconn* conn;
-  req_t* live;
   queue_t queue;
+  /* requests already sent, in the order their results will come back */
+  queue_t inflight;
+  int pipelineDepth;
+  bool pipelined;
+  stmt_cache_t* stmtCache;
   int fd;
   int eventmask;
   enum pquv_error_t err;
@@ -69,13 +163,57 @@ struct pquv_st {
   init_cb connectionCB;
   void* connectionOpaque;
   bool alreadyDisconnected;
+  /* cancel requests on their way to the server, nothing new is sent until
+   * they are done as they would cancel whatever query runs when they arrive */
+  int cancelling;
+  /* timeouts given to new requests, 0 for none, and the single timer armed
+   * for the earliest deadline of all requests */
+  int queueTimeoutMs;
+  int execTimeoutMs;
+  uv_timer_t deadline_timer;
+  uint64_t nextDeadline;
+  /* admission limits, 0 for none, see `pquv_set_queue_limits` */
+  int maxQueueLength;
+  size_t maxPendingBytes;
+  size_t pendingBytes;
+  pquv_stats_t* stats;
+  /* freed requests, linked through `next`, reused before allocating */
+  req_t* freeReqs;
+  int freeReqsLength;
 };
 
+/* connection whose request callback is running and the time the result was
+ * handed to it, see `pquv_result_decoded` */
+static pquv_t* decodingConn = NULL;
+static uint64_t decodingSince = 0;
+
+static void enqueue(queue_t* queue, req_t* r) {
+  r->next = NULL;
+  if (queue->head == NULL) {
+    queue->head = r;
+    queue->tail = r;
+  } else {
+    queue->tail->next = r;
+    queue->tail = r;
+  }
+  queue->length += 1;
+}
+
+static void unlink_req(queue_t* queue, req_t* prev, req_t* r) {
+  if (prev == NULL) queue->head = r->next;
+  else prev->next = r->next;
+  if (queue->tail == r) queue->tail = prev;
+  queue->length -= 1;
+  r->next = NULL;
+}
+
 static req_t* dequeue(queue_t* queue) {
   if (queue->head == NULL) return NULL;
 
   req_t* t = queue->head;
   queue->head = t->next;
+  if (queue->head == NULL) queue->tail = NULL;
+  queue->length -= 1;
   t->next = NULL;
   return t;
 }
@@ -101,65 +239,633 @@ static void update_poll_eventmask(pquv_t* pquv, int eventmask) {
   }
 }
 
-static bool maybe_send_req(pquv_t* pquv) {
-  if (pquv->live != NULL) {
+static void free_req(pquv_t* pquv, req_t* r);
+
+static req_t* alloc_req(pquv_t* pquv) {
+  req_t* r = pquv->freeReqs;
+  if (r == NULL) return (req_t*)GC_MALLOC_UNCOLLECTABLE(sizeof(*r));
+
+  pquv->freeReqs = r->next;
+  pquv->freeReqsLength -= 1;
+  r->next = NULL;
+  return r;
+}
+
+static uint64_t hash_stmt(const char* q, int nParams, const Oid* paramTypes) {
+  uint64_t hash = 14695981039346656037ULL;
+
+  for (const char* c = q; *c != '\0'; c++) {
+    hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+  }
+  for (int i = 0; i < nParams && paramTypes != NULL; i++) {
+    hash = (hash ^ paramTypes[i]) * 1099511628211ULL;
+  }
+
+  return hash;
+}
+
+static bool stmt_matches(stmt_t* st, uint64_t hash, const char* q, int nParams, const Oid* paramTypes) {
+  if (st->hash != hash || st->nParams != nParams || strcmp(st->q, q) != 0) {
     return false;
   }
+  for (int i = 0; i < nParams; i++) {
+    Oid a = st->paramTypes != NULL ? st->paramTypes[i] : 0;
+    Oid b = paramTypes != NULL ? paramTypes[i] : 0;
+    if (a != b) return false;
+  }
+  return true;
+}
 
-  if (PQstatus(pquv->conn) == CONNECTION_BAD) {
-    // TODO: reset connection
-    NULL;  // failwith("connection is bad");
+static void stmt_unlink(stmt_cache_t* cache, stmt_t* st) {
+  if (st->prev != NULL) st->prev->next = st->next;
+  else cache->head = st->next;
+  if (st->next != NULL) st->next->prev = st->prev;
+  else cache->tail = st->prev;
+  st->prev = NULL;
+  st->next = NULL;
+}
+
+static void stmt_push_front(stmt_cache_t* cache, stmt_t* st) {
+  st->prev = NULL;
+  st->next = cache->head;
+  if (cache->head != NULL) cache->head->prev = st;
+  cache->head = st;
+  if (cache->tail == NULL) cache->tail = st;
+}
+
+static stmt_t* cache_lookup(stmt_cache_t* cache, const char* q, int nParams, const Oid* paramTypes) {
+  uint64_t hash = hash_stmt(q, nParams, paramTypes);
+  stmt_t* st = cache->buckets[hash % STMT_CACHE_BUCKETS];
+
+  while (st != NULL && !stmt_matches(st, hash, q, nParams, paramTypes)) {
+    st = st->bucketNext;
   }
 
-  req_t* r = dequeue(&pquv->queue);
-  if (r == NULL) {
-    return false;
+  if (st != NULL && st != cache->head) {
+    stmt_unlink(cache, st);
+    stmt_push_front(cache, st);
+  }
+
+  return st;
+}
+
+/* removing a statement that is no longer cached is a noop, the requests
+ * executing it still hold a reference to it */
+static void cache_remove(stmt_cache_t* cache, stmt_t* st) {
+  if (!st->cached) return;
+
+  stmt_t** link = &cache->buckets[st->hash % STMT_CACHE_BUCKETS];
+  while (*link != st) link = &(*link)->bucketNext;
+  *link = st->bucketNext;
+  st->bucketNext = NULL;
+
+  stmt_unlink(cache, st);
+  st->cached = false;
+  cache->length -= 1;
+}
+
+static stmt_t* cache_insert(stmt_cache_t* cache, const char* q, int nParams, const Oid* paramTypes) {
+  stmt_t* st = (stmt_t*)GC_MALLOC(sizeof(*st));
+  size_t length = strlen(q);
+  char* qCopy = (char*)GC_MALLOC_ATOMIC(length + 1);
+  memcpy(qCopy, q, length + 1);
+
+  st->q = qCopy;
+  st->nParams = nParams;
+  if (paramTypes != NULL && nParams) {
+    Oid* types = (Oid*)GC_MALLOC_ATOMIC(sizeof(Oid) * nParams);
+    memcpy(types, paramTypes, sizeof(Oid) * nParams);
+    st->paramTypes = types;
+  } else {
+    st->paramTypes = NULL;
+  }
+  st->hash = hash_stmt(q, nParams, paramTypes);
+  snprintf(st->name, sizeof(st->name), "pquv_%u", statementIndex);
+  statementIndex += 1;
+
+  st->bucketNext = cache->buckets[st->hash % STMT_CACHE_BUCKETS];
+  cache->buckets[st->hash % STMT_CACHE_BUCKETS] = st;
+  stmt_push_front(cache, st);
+  st->cached = true;
+  cache->length += 1;
+
+  return st;
+}
+
+/* prepared statements only live as long as the server session */
+static void cache_clear(stmt_cache_t* cache) {
+  while (cache->head != NULL) {
+    cache_remove(cache, cache->head);
+  }
+}
+
+/* the connection may only switch in or out of pipeline mode while no result
+ * is pending */
+static void set_pipeline_mode(pquv_t* pquv, bool enabled) {
+#ifdef LIBPQ_HAS_PIPELINING
+  if (pquv->inflight.head != NULL) {
+    return;
+  }
+
+  if (enabled && !pquv->pipelined) {
+    pquv->pipelined = PQenterPipelineMode(pquv->conn) == 1;
+  } else if (!enabled && pquv->pipelined) {
+    pquv->pipelined = PQexitPipelineMode(pquv->conn) != 1;
+  }
+#endif
+}
+
+/* COPY is not allowed in pipeline mode, such requests are sent alone once
+ * the pipeline is drained */
+static bool is_exclusive(req_t* r) {
+  return r->kind == PQUV_COPY_IN || r->kind == PQUV_COPY_OUT;
+}
+
+static int max_inflight(pquv_t* pquv) {
+  return pquv->pipelined ? pquv->pipelineDepth : 1;
+}
+
+static bool is_partial_result(PGresult* res) {
+  ExecStatusType status = PQresultStatus(res);
+#ifdef LIBPQ_HAS_CHUNK_MODE
+  if (status == PGRES_TUPLES_CHUNK) return true;
+#endif
+  return status == PGRES_SINGLE_TUPLE;
+}
+
+/* the last result handed to the callback of `r`: the one after the partial
+ * results of a stream, the sync point of a multi statement request */
+static bool is_final_result(req_t* r, PGresult* res) {
+  if (res == NULL) return true;
+#ifdef LIBPQ_HAS_PIPELINING
+  if (r->kind == PQUV_MULTI_STATEMENT) return PQresultStatus(res) == PGRES_PIPELINE_SYNC;
+#endif
+  return !is_partial_result(res);
+}
+
+static uint64_t elapsed_us(uint64_t since, uint64_t now) { return since != 0 && now > since ? (now - since) / 1000 : 0; }
+
+/* counts a result about to be handed to a callback, and once it is the
+ * complete result of a request the durations of its stages. `r` is NULL for
+ * abandoned requests, which only get a NULL result. */
+static void record_result(pquv_t* pquv, req_t* r, PGresult* res, uint64_t now) {
+  pquv_stats_t* stats = pquv->stats;
+
+  if (res == NULL) {
+    stats->queries += 1;
+    stats->errors += 1;
+    stats->timeouts += 1;
+    return;
+  }
+
+  stats->rows += PQntuples(res);
+  if (!is_final_result(r, res)) return;
+
+  ExecStatusType status = PQresultStatus(res);
+  stats->queries += 1;
+  if (status == PGRES_FATAL_ERROR || status == PGRES_BAD_RESPONSE) stats->errors += 1;
+
+  if (r->sentAt != 0) {
+    histogram_record(&stats->queued, elapsed_us(r->queuedAt, r->sentAt));
+    histogram_record(&stats->server, elapsed_us(r->sentAt, r->firstResultAt));
+    histogram_record(&stats->transfer, elapsed_us(r->firstResultAt, now));
+  }
+  histogram_record(&stats->total, elapsed_us(r->queuedAt, now));
+}
+
+/* hands `res` to the callback of `r`, which must have one */
+static void deliver(pquv_t* pquv, req_t* r, PGresult* res) {
+  uint64_t now = uv_hrtime();
+  if (r->firstResultAt == 0) r->firstResultAt = now;
+  record_result(pquv, r, res, now);
+
+  /* callbacks can run from other callbacks, when they disconnect */
+  pquv_t* outerConn = decodingConn;
+  uint64_t outerSince = decodingSince;
+  decodingConn = res != NULL && is_final_result(r, res) ? pquv : NULL;
+  decodingSince = now;
+
+  r->cb(r->opaque, res);
+
+  decodingConn = outerConn;
+  decodingSince = outerSince;
+}
+
+/* fails a request that never made it to the server, the error result carries
+ * the current error message of the connection */
+static void fail_req(pquv_t* pquv, req_t* r) {
+  if (r->cb != NULL) deliver(pquv, r, PQmakeEmptyPGresult(pquv->conn, PGRES_FATAL_ERROR));
+  free_req(pquv, r);
+}
+
+/* requests without callback are internal, their results are dropped */
+static req_t* make_internal_req(pquv_t* pquv, const char* q) {
+  req_t* r = alloc_req(pquv);
+  r->kind = PQUV_NORMAL_STATEMENT;
+  r->q = q;
+  r->name = NULL;
+  r->flags = PQUV_NON_VOLATILE_QUERY_STRING | PQUV_NON_VOLATILE_NAME_STRING;
+  r->nParams = 0;
+  r->paramTypes = NULL;
+  r->paramValues = NULL;
+  r->paramLengths = NULL;
+  r->paramFormats = NULL;
+  r->cb = NULL;
+  r->opaque = NULL;
+  r->delivered = false;
+  r->stmt = NULL;
+  r->skipResults = 0;
+  r->chunkSize = 1;
+  r->rowModeSet = false;
+  r->cancelOnceAlone = false;
+  r->stmtReused = false;
+  r->staleRes = NULL;
+  r->resent = false;
+  r->copyCB = NULL;
+  r->copyOutCB = NULL;
+  r->copyState = PQUV_COPY_NONE;
+  r->copyBuf = NULL;
+  r->copyPending = 0;
+  r->copyFailed = false;
+  r->queueDeadline = 0;
+  r->execDeadline = 0;
+  r->execTimeoutMs = 0;
+  r->bytes = 0;
+  r->queuedAt = 0;
+  r->sentAt = 0;
+  r->firstResultAt = 0;
+  return r;
+}
+
+/* the statement leaving the cache is deallocated on the server, after the
+ * requests already sent that may still execute it. A deallocation queued
+ * without its sync point is partly sent. */
+static enum pquv_send_t evict_stmt(pquv_t* pquv, stmt_t* st) {
+  cache_remove(pquv->stmtCache, st);
+
+#ifdef LIBPQ_HAS_CLOSE_PREPARED
+  if (!PQsendClosePrepared(pquv->conn, st->name)) return PQUV_NOT_SENT;
+  req_t* r = make_internal_req(pquv, NULL);
+#else
+  size_t length = strlen(st->name) + sizeof("DEALLOCATE ");
+  char* q = (char*)GC_MALLOC_ATOMIC(length);
+  snprintf(q, length, "DEALLOCATE %s", st->name);
+  if (!PQsendQueryParams(pquv->conn, q, 0, NULL, NULL, NULL, NULL, 1)) return PQUV_NOT_SENT;
+  req_t* r = make_internal_req(pquv, q);
+#endif
+
+  enqueue(&pquv->inflight, r);
+  return PQpipelineSync(pquv->conn) ? PQUV_SENT : PQUV_PARTLY_SENT;
+}
+
+/* sends the query as a named statement, the Parse step is only pipelined
+ * ahead of the execution the first time the query is seen */
+static enum pquv_send_t send_cached_req(pquv_t* pquv, req_t* r) {
+  stmt_cache_t* cache = pquv->stmtCache;
+  stmt_t* st = cache_lookup(cache, r->q, r->nParams, r->paramTypes);
+
+  if (st == NULL) {
+    while (cache->length >= cache->capacity && cache->tail != NULL) {
+      enum pquv_send_t evicted = evict_stmt(pquv, cache->tail);
+      if (evicted != PQUV_SENT) return evicted;
+    }
+
+    st = cache_insert(cache, r->q, r->nParams, r->paramTypes);
+    if (!PQsendPrepare(pquv->conn, st->name, r->q, r->nParams, r->paramTypes)) {
+      cache_remove(cache, st);
+      return PQUV_NOT_SENT;
+    }
+    r->skipResults = 1;
+  }
+
+  r->stmt = st;
+  r->stmtReused = r->skipResults == 0;
+  if (!PQsendQueryPrepared(pquv->conn, st->name, r->nParams, r->paramValues, r->paramLengths, r->paramFormats, 1)) {
+    /* whether the Parse step made it or not, the statement is unknown */
+    cache_remove(cache, st);
+    return r->skipResults > 0 ? PQUV_PARTLY_SENT : PQUV_NOT_SENT;
+  }
+
+  return PQUV_SENT;
+}
+
+/* Finds the next statement of `q` from `*start`, skipping the semicolons in
+ * quoted strings, quoted identifiers, dollar quoted strings and comments.
+ * Sets `*end` past its last character and returns false once only blanks
+ * and comments are left. */
+static bool next_statement(const char* q, size_t* start, size_t* end) {
+  size_t i = *start;
+  size_t first = 0;
+  bool found = false;
+
+  while (q[i] != '\0' && q[i] != ';') {
+    char c = q[i];
+
+    if (c == '-' && q[i + 1] == '-') {
+      while (q[i] != '\0' && q[i] != '\n') i++;
+      continue;
+    }
+
+    if (c == '/' && q[i + 1] == '*') {
+      int depth = 1;
+      i += 2;
+      while (q[i] != '\0' && depth > 0) {
+        if (q[i] == '/' && q[i + 1] == '*') {
+          depth++;
+          i += 2;
+        } else if (q[i] == '*' && q[i + 1] == '/') {
+          depth--;
+          i += 2;
+        } else {
+          i++;
+        }
+      }
+      continue;
+    }
+
+    if (!found && c != ' ' && c != '\t' && c != '\n' && c != '\r') {
+      found = true;
+      first = i;
+    }
+
+    bool identChar = i > 0 && (isalnum((unsigned char)q[i - 1]) || q[i - 1] == '_' || q[i - 1] == '$');
+
+    if (c == '\'' || c == '"') {
+      /* backslashes only escape in E'' strings */
+      bool escapes = c == '\'' && i > 0 && (q[i - 1] == 'E' || q[i - 1] == 'e') &&
+                     !(i > 1 && (isalnum((unsigned char)q[i - 2]) || q[i - 2] == '_'));
+      i++;
+      while (q[i] != '\0') {
+        if (escapes && q[i] == '\\' && q[i + 1] != '\0') {
+          i += 2;
+        } else if (q[i] == c && q[i + 1] == c) {
+          i += 2;
+        } else if (q[i] == c) {
+          i++;
+          break;
+        } else {
+          i++;
+        }
+      }
+      continue;
+    }
+
+    if (c == '$' && !identChar) {
+      /* $tag$ with an empty or identifier tag, not a $1 parameter */
+      size_t tagEnd = i + 1;
+      if (!isdigit((unsigned char)q[tagEnd])) {
+        while (isalnum((unsigned char)q[tagEnd]) || q[tagEnd] == '_') tagEnd++;
+      }
+      if (q[tagEnd] == '$') {
+        size_t tagLength = tagEnd - i + 1;
+        const char* close = strstr(q + tagEnd + 1, "$");
+        while (close != NULL && strncmp(close, q + i, tagLength) != 0) close = strstr(close + 1, "$");
+        i = close != NULL ? close - q + tagLength : strlen(q);
+        continue;
+      }
+    }
+
+    i++;
   }
 
+  *start = first;
+  *end = i;
+  return found;
+}
+
+/* sends each statement of the query of `r` as its own query, with the single
+ * sync point that follows the request: like the statements of a simple
+ * query they run in one implicit transaction, and a failing one aborts the
+ * ones after it */
+static enum pquv_send_t send_statements(pquv_t* pquv, req_t* r, int* sentCount) {
+  *sentCount = 0;
+  if (!pquv->pipelined) return PQUV_NOT_SENT;
+
+  size_t length = strlen(r->q);
+  char* statement = (char*)malloc(length + 1);
+  if (statement == NULL) return PQUV_NOT_SENT;
+
+  size_t position = 0;
+  enum pquv_send_t sent = PQUV_SENT;
+
+  while (sent == PQUV_SENT && position < length) {
+    size_t start = position;
+    size_t end;
+    bool found = next_statement(r->q, &start, &end);
+    position = end + 1;
+    if (!found) continue;
+
+    memcpy(statement, r->q + start, end - start);
+    statement[end - start] = '\0';
+    if (PQsendQueryParams(pquv->conn, statement, 0, NULL, NULL, NULL, NULL, 1)) {
+      *sentCount += 1;
+    } else {
+      sent = *sentCount > 0 ? PQUV_PARTLY_SENT : PQUV_NOT_SENT;
+    }
+  }
+
+  free(statement);
+  return sent;
+}
+
+/* the row mode applies to the query libpq is currently processing and must
+ * be set before any of its results are parsed: right after sending it, or
+ * in pipeline mode right after the results of the previous query */
+static void set_row_mode(pquv_t* pquv, req_t* r) {
+  if (r->rowModeSet || !(r->flags & PQUV_SINGLE_ROW) || r->skipResults > 0) return;
+
+#ifdef LIBPQ_HAS_CHUNK_MODE
+  if (r->chunkSize > 1) {
+    r->rowModeSet = PQsetChunkedRowsMode(pquv->conn, r->chunkSize) == 1;
+    return;
+  }
+#endif
+  r->rowModeSet = PQsetSingleRowMode(pquv->conn) == 1;
+}
+
+static enum pquv_send_t send_req(pquv_t* pquv, req_t* r) {
+  enum pquv_send_t sent = PQUV_SENT;
+  /* whether the sync point would follow queued commands of the request */
+  bool queued = true;
+
   switch (r->kind) {
-    case PQUV_NORMAL_STATEMENT: {
-      // char *statementName = (char *) GC_MALLOC(64);
-      // sprintf(statementName, "%d", statementIndex);
-      // statementIndex += 1;
-      // PGresult *res = PQprepare(pquv->conn, statementName, r->q, 0, NULL);
-
-      // if (PQresultStatus(res) > 6) {
-      //   char *resultErrorMessage = PQresultErrorMessage(res);
-      //   r->cb(r->opaque, res);
-      //   setError(pquv, PQUV_ERROR_BAD_QUERY);
-      //   return false;
-      // } else {
-      //   PQsendQueryPrepared(pquv->conn, statementName, 0, NULL, NULL, NULL, 1);
-      // }
-      // TODO: verify that this is correct, but since we don't use the params
-      // at the moment it should be fine
-      // if (!PQsendQuery(pquv->conn, r->q)) {
-      if (!PQsendQueryParams(pquv->conn, r->q, r->nParams, r->paramTypes, r->paramValues, r->paramLengths,
-                             r->paramFormats, 1)) {
-        NULL;  // failwith("PQsendQuery: %s\n", PQerrorMessage(pquv->conn));
+    case PQUV_NORMAL_STATEMENT:
+      /* the Parse step can only be sent ahead of the execution in pipeline
+       * mode */
+      if ((r->flags & PQUV_CACHE_STATEMENT) && pquv->pipelined && pquv->stmtCache->capacity > 0) {
+        sent = send_cached_req(pquv, r);
+      } else if (!PQsendQueryParams(pquv->conn, r->q, r->nParams, r->paramTypes, r->paramValues, r->paramLengths,
+                                    r->paramFormats, 1)) {
+        sent = PQUV_NOT_SENT;
       }
       break;
-    }
     case PQUV_PREPARE_STATEMENT:
       if (!PQsendPrepare(pquv->conn, r->name, r->q, r->nParams, r->paramTypes)) {
-        NULL;  // failwith("PQSendPerpare: %s\n", PQerrorMessage(pquv->conn));
+        sent = PQUV_NOT_SENT;
       }
       break;
     case PQUV_PREPARED_STATEMENT:
       if (!PQsendQueryPrepared(pquv->conn, r->name, r->nParams, r->paramValues, r->paramLengths, r->paramFormats, 1)) {
-        NULL;  // failwith("PQsendQueryPrepared: %s\n", PQerrorMessage(pquv->conn));
+        sent = PQUV_NOT_SENT;
       }
       break;
+    case PQUV_COPY_IN:
+    case PQUV_COPY_OUT:
+      if (!PQsendQueryParams(pquv->conn, r->q, 0, NULL, NULL, NULL, NULL, 1)) {
+        sent = PQUV_NOT_SENT;
+      }
+      break;
+    case PQUV_MULTI_STATEMENT: {
+      int sentCount;
+      sent = send_statements(pquv, r, &sentCount);
+      queued = sentCount > 0;
+      break;
+    }
+  }
+
+  if (sent != PQUV_SENT) return sent;
+
+#ifdef LIBPQ_HAS_PIPELINING
+  if (pquv->pipelined && !PQpipelineSync(pquv->conn)) {
+    return queued ? PQUV_PARTLY_SENT : PQUV_NOT_SENT;
+  }
+#endif
+
+  if (!pquv->pipelined) set_row_mode(pquv, r);
+
+  return PQUV_SENT;
+}
+
+static void arm_deadline(pquv_t* pquv, uint64_t deadline);
+
+/* the execution time is counted from the moment the request is sent */
+static void start_exec_deadline(pquv_t* pquv, req_t* r) {
+  r->queueDeadline = 0;
+  if (r->execTimeoutMs > 0) {
+    r->execDeadline = uv_now(pquv->loop) + r->execTimeoutMs;
+    arm_deadline(pquv, r->execDeadline);
+  }
+}
+
+static void reconnect_timer_cb(uv_timer_t* h);
+
+/* Once libpq took part of a request, the results of the server no longer
+ * line up with the requests in flight. They fail and the connection is made
+ * again from the reconnect timer, the queued requests wait for it. */
+static void reset_connection(pquv_t* pquv) {
+  uv_poll_stop(&pquv->poll);
+  pquv->eventmask = 0;
+  pquv->state = PQUV_BAD_CONNECTION;
+
+  req_t* r;
+  while ((r = dequeue(&pquv->inflight)) != NULL) {
+    if (r->delivered || r->cb == NULL) {
+      free_req(pquv, r);
+    } else {
+      fail_req(pquv, r);
+    }
+  }
+
+  if (!pquv->alreadyDisconnected) {
+    uv_timer_start(&pquv->reconnect_timer, reconnect_timer_cb, 0, 0);
+  }
+}
+
+/* sends as many queued requests as the pipeline depth allows, returns true if
+ * at least one request was sent */
+static bool maybe_send_req(pquv_t* pquv) {
+  bool sent = false;
+
+  while (pquv->queue.head != NULL && pquv->cancelling == 0) {
+    req_t* r = pquv->queue.head;
+    req_t* running = pquv->inflight.head;
+
+    if (running != NULL && (is_exclusive(r) || is_exclusive(running) || running->cancelOnceAlone)) {
+      break;
+    }
+
+    if (running == NULL) {
+      set_pipeline_mode(pquv, r->kind == PQUV_MULTI_STATEMENT || (!is_exclusive(r) && pquv->pipelineDepth > 1));
+    }
+
+    if (pquv->inflight.length >= max_inflight(pquv)) {
+      break;
+    }
+
+    dequeue(&pquv->queue);
+    enum pquv_send_t sendResult = send_req(pquv, r);
+    if (sendResult == PQUV_NOT_SENT) {
+      fail_req(pquv, r);
+      continue;
+    }
+
+    if (sendResult == PQUV_PARTLY_SENT) {
+      /* the results of what did reach libpq would be taken for the ones of
+       * the next requests */
+      enqueue(&pquv->inflight, r);
+      reset_connection(pquv);
+      return sent;
+    }
+
+    r->sentAt = uv_hrtime();
+    pquv->stats->bytesSent += r->bytes;
+    start_exec_deadline(pquv, r);
+    enqueue(&pquv->inflight, r);
+    sent = true;
   }
 
-  pquv->live = r;
+  return sent;
+}
+
+/* what a request weighs in the budget of the connection */
+static size_t req_bytes(const char* q, int nParams, const char* const* paramValues, const int* paramLengths,
+                        const int* paramFormats) {
+  size_t bytes = q != NULL ? strlen(q) : 0;
+
+  for (int i = 0; i < nParams && paramValues != NULL; i++) {
+    if (paramValues[i] == NULL) continue;
+    /* the lengths of text parameters are ignored by libpq */
+    bool binary = paramFormats != NULL && paramFormats[i] == 1;
+    bytes += binary && paramLengths != NULL ? paramLengths[i] : strlen(paramValues[i]);
+  }
+
+  return bytes;
+}
+
+/* A request is turned down when the queue is full or the requests pending
+ * on the connection already take the byte budget. A connection with nothing
+ * pending takes any request, however large. */
+static bool admits(pquv_t* pquv, size_t bytes) {
+  if (pquv->maxQueueLength > 0 && pquv->queue.length >= pquv->maxQueueLength) return false;
+  if (pquv->maxPendingBytes > 0 && pquv->pendingBytes > 0 && pquv->pendingBytes + bytes > pquv->maxPendingBytes) {
+    return false;
+  }
   return true;
 }
 
-static void enqueue_req(pquv_t* pquv, enum pquv_req_kind_t kind, const char* q, const char* name, int nParams,
-                        const Oid* paramTypes, const char* const* paramValues, const int* paramLengths,
-                        const int* paramFormats, req_cb cb, void* opaque, uint32_t flags) {
-  req_t* r = (req_t*)GC_MALLOC_UNCOLLECTABLE(sizeof(*r));
+/* copies a parameter array of the caller, into the request when it is small
+ * enough */
+static const void* copy_params(void* inlineParams, const void* params, size_t size, int nParams) {
+  if (params == NULL || nParams == 0) return NULL;
+
+  void* copy = nParams <= REQ_INLINE_PARAMS ? inlineParams : GC_MALLOC_UNCOLLECTABLE(size * nParams);
+  memcpy(copy, params, size * nParams);
+  return copy;
+}
+
+/* returns NULL when the request isn't admitted */
+static req_t* enqueue_req(pquv_t* pquv, enum pquv_req_kind_t kind, const char* q, const char* name, int nParams,
+                          const Oid* paramTypes, const char* const* paramValues, const int* paramLengths,
+                          const int* paramFormats, req_cb cb, void* opaque, uint32_t flags) {
+  size_t bytes = req_bytes(q, nParams, paramValues, paramLengths, paramFormats);
+  if (!admits(pquv, bytes)) {
+    pquv->stats->rejected += 1;
+    return NULL;
+  }
+
+  req_t* r = alloc_req(pquv);
+  r->bytes = bytes;
+  pquv->pendingBytes += bytes;
   r->flags = flags;
   r->kind = kind;
   r->nParams = nParams;
@@ -167,7 +873,7 @@ static void enqueue_req(pquv_t* pquv, enum pquv_req_kind_t kind, const char* q,
   if (flags & PQUV_NON_VOLATILE_QUERY_STRING) {
     r->q = q;
   } else {
-    r->q = q ? strndup(q, MAX_QUERY_LENGTH) : NULL;
+    r->q = q ? strdup(q) : NULL;
   }
 
   if (flags & PQUV_NON_VOLATILE_NAME_STRING) {
@@ -176,80 +882,372 @@ static void enqueue_req(pquv_t* pquv, enum pquv_req_kind_t kind, const char* q,
     r->name = name ? strndup(name, MAX_NAME_LENGTH) : NULL;
   }
 
-  if (paramTypes != NULL && nParams) {
-    size_t n = sizeof(const char*) * nParams;
-    r->paramTypes = (Oid*)GC_MALLOC_UNCOLLECTABLE(n);
-    memcpy((void*)r->paramTypes, paramTypes, n);
-  } else {
-    r->paramTypes = NULL;
+  r->paramTypes = (const Oid*)copy_params(r->inlineTypes, paramTypes, sizeof(Oid), nParams);
+  r->paramValues = (const char* const*)copy_params(r->inlineValues, paramValues, sizeof(const char*), nParams);
+  r->paramLengths = (const int*)copy_params(r->inlineLengths, paramLengths, sizeof(int), nParams);
+  r->paramFormats = (const int*)copy_params(r->inlineFormats, paramFormats, sizeof(int), nParams);
+
+  r->cb = cb;
+  r->opaque = opaque;
+  r->delivered = false;
+  r->stmt = NULL;
+  r->skipResults = 0;
+  r->chunkSize = 1;
+  r->rowModeSet = false;
+  r->cancelOnceAlone = false;
+  r->stmtReused = false;
+  r->staleRes = NULL;
+  r->resent = false;
+  r->copyCB = NULL;
+  r->copyOutCB = NULL;
+  r->copyState = PQUV_COPY_NONE;
+  r->copyBuf = NULL;
+  r->copyPending = 0;
+  r->copyFailed = false;
+  r->queueDeadline = pquv->queueTimeoutMs > 0 ? uv_now(pquv->loop) + pquv->queueTimeoutMs : 0;
+  r->execDeadline = 0;
+  r->execTimeoutMs = pquv->execTimeoutMs;
+  r->queuedAt = uv_hrtime();
+  r->sentAt = 0;
+  r->firstResultAt = 0;
+  enqueue(&pquv->queue, r);
+  if (r->queueDeadline > 0) arm_deadline(pquv, r->queueDeadline);
+
+  if (pquv->state == PQUV_CONNECTED && pquv->inflight.length < max_inflight(pquv)) {
+    update_poll_eventmask(pquv, pquv->eventmask | UV_WRITABLE);
   }
 
-  if (paramValues != NULL && nParams) {
-    size_t n = sizeof(const char*) * nParams;
-    r->paramValues = (const char* const*)GC_MALLOC_UNCOLLECTABLE(n);
-    memcpy((void*)r->paramValues, paramValues, n);
-  } else {
-    r->paramValues = NULL;
+  return r;
+}
+
+int pquv_query_params(pquv_t* pquv, const char* q, int nParams, const Oid* paramTypes, const char* const* paramValues,
+                      const int* paramLengths, const int* paramFormats, req_cb cb, void* opaque, uint32_t flags) {
+  req_t* r = enqueue_req(pquv, PQUV_NORMAL_STATEMENT, q, NULL, nParams, paramTypes, paramValues, paramLengths,
+                         paramFormats, cb, opaque, flags);
+  return r == NULL ? PQUV_ERROR_OVERLOADED : PQUV_ERROR_NONE;
+}
+
+int pquv_query_multi(pquv_t* pquv, const char* q, req_cb cb, void* opaque, uint32_t flags) {
+  req_t* r = enqueue_req(pquv, PQUV_MULTI_STATEMENT, q, NULL, 0, NULL, NULL, NULL, NULL, cb, opaque, flags);
+  return r == NULL ? PQUV_ERROR_OVERLOADED : PQUV_ERROR_NONE;
+}
+
+int pquv_query_stream(pquv_t* pquv, const char* q, int nParams, const Oid* paramTypes, const char* const* paramValues,
+                      const int* paramLengths, const int* paramFormats, int chunkSize, req_cb cb, void* opaque,
+                      uint32_t flags) {
+  req_t* r = enqueue_req(pquv, PQUV_NORMAL_STATEMENT, q, NULL, nParams, paramTypes, paramValues, paramLengths,
+                         paramFormats, cb, opaque, flags | PQUV_SINGLE_ROW);
+  if (r == NULL) return PQUV_ERROR_OVERLOADED;
+  r->chunkSize = chunkSize;
+  return PQUV_ERROR_NONE;
+}
+
+int pquv_copy_in(pquv_t* pquv, const char* q, copy_in_cb dataCB, req_cb cb, void* opaque, uint32_t flags) {
+  req_t* r = enqueue_req(pquv, PQUV_COPY_IN, q, NULL, 0, NULL, NULL, NULL, NULL, cb, opaque, flags);
+  if (r == NULL) return PQUV_ERROR_OVERLOADED;
+  r->copyCB = dataCB;
+  return PQUV_ERROR_NONE;
+}
+
+int pquv_copy_out(pquv_t* pquv, const char* q, copy_out_cb dataCB, req_cb cb, void* opaque, uint32_t flags) {
+  req_t* r = enqueue_req(pquv, PQUV_COPY_OUT, q, NULL, 0, NULL, NULL, NULL, NULL, cb, opaque, flags);
+  if (r == NULL) return PQUV_ERROR_OVERLOADED;
+  r->copyOutCB = dataCB;
+  return PQUV_ERROR_NONE;
+}
+
+int pquv_prepare(pquv_t* pquv, const char* q, const char* name, int nParams, const Oid* paramTypes, req_cb cb,
+                 void* opaque, uint32_t flags) {
+  req_t* r =
+      enqueue_req(pquv, PQUV_PREPARE_STATEMENT, q, name, nParams, paramTypes, NULL, NULL, NULL, cb, opaque, flags);
+  return r == NULL ? PQUV_ERROR_OVERLOADED : PQUV_ERROR_NONE;
+}
+
+int pquv_prepared(pquv_t* pquv, const char* name, int nParams, const char* const* paramValues, const int* paramLengths,
+                  const int* paramFormats, req_cb cb, void* opaque, uint32_t flags) {
+  req_t* r = enqueue_req(pquv, PQUV_PREPARED_STATEMENT, NULL, name, nParams, NULL, paramValues, paramLengths,
+                         paramFormats, cb, opaque, flags);
+  return r == NULL ? PQUV_ERROR_OVERLOADED : PQUV_ERROR_NONE;
+}
+
+/* the request goes back to the free list of the connection, without the
+ * references it held so that they can be collected */
+static void free_req(pquv_t* pquv, req_t* r) {
+  pquv->pendingBytes -= r->bytes;
+  if (!(r->flags & PQUV_NON_VOLATILE_QUERY_STRING)) free((void*)r->q);
+  if (!(r->flags & PQUV_NON_VOLATILE_NAME_STRING)) free((void*)r->name);
+
+  if (r->nParams > REQ_INLINE_PARAMS) {
+    GC_FREE((void*)r->paramTypes);
+    GC_FREE((void*)r->paramValues);
+    GC_FREE((void*)r->paramLengths);
+    GC_FREE((void*)r->paramFormats);
+  } else if (r->paramValues != NULL) {
+    memset(r->inlineValues, 0, sizeof(const char*) * r->nParams);
   }
 
-  if (paramLengths != NULL && nParams) {
-    size_t n = sizeof(const int*) * nParams;
-    r->paramLengths = (const int*)GC_MALLOC_UNCOLLECTABLE(n);
-    memcpy((void*)r->paramLengths, paramLengths, n);
-  } else {
-    r->paramLengths = NULL;
+  if (r->staleRes != NULL) {
+    PQclear(r->staleRes);
+    r->staleRes = NULL;
   }
 
-  if (paramFormats != NULL && nParams) {
-    size_t n = sizeof(const int*) * nParams;
-    r->paramFormats = (const int*)GC_MALLOC_UNCOLLECTABLE(n);
-    memcpy((void*)r->paramFormats, paramFormats, n);
-  } else {
-    r->paramFormats = NULL;
+  if (pquv->freeReqsLength >= REQ_FREE_LIST_LENGTH) {
+    GC_FREE(r);
+    return;
   }
 
-  r->cb = cb;
-  r->opaque = opaque;
-  r->next = NULL;
+  r->q = NULL;
+  r->name = NULL;
+  r->opaque = NULL;
+  r->stmt = NULL;
+  r->copyBuf = NULL;
+  r->next = pquv->freeReqs;
+  pquv->freeReqs = r;
+  pquv->freeReqsLength += 1;
+}
 
-  if (pquv->queue.head == NULL) {
-    pquv->queue.head = r;
-    pquv->queue.tail = r;
-  } else {
-    pquv->queue.tail->next = r;
-    pquv->queue.tail = r;
+/* fails every request that is still waiting for a result, used once the
+ * connection is gone */
+static void fail_pending(pquv_t* pquv) {
+  req_t* r;
+
+  while ((r = dequeue(&pquv->inflight)) != NULL) {
+    if (r->delivered || r->cb == NULL) {
+      free_req(pquv, r);
+    } else {
+      fail_req(pquv, r);
+    }
   }
 
-  if (pquv->state == PQUV_CONNECTED && pquv->live == NULL) {
-    update_poll_eventmask(pquv, pquv->eventmask | UV_WRITABLE);
+  while ((r = dequeue(&pquv->queue)) != NULL) {
+    fail_req(pquv, r);
+  }
+}
+
+/* A request whose statement went stale is sent again when nothing could
+ * tell: no transaction is left open by it or before it, and no request was
+ * pipelined after it, which would now run first. */
+static bool can_resend(pquv_t* pquv) {
+  if (PQtransactionStatus(pquv->conn) != PQTRANS_IDLE) return false;
+
+  for (req_t* next = pquv->inflight.head; next != NULL; next = next->next) {
+    if (next->cb != NULL) return false;
   }
+  return true;
 }
 
-void pquv_query_params(pquv_t* pquv, const char* q, int nParams, const Oid* paramTypes, const char* const* paramValues,
-                       const int* paramLengths, const int* paramFormats, req_cb cb, void* opaque, uint32_t flags) {
-  enqueue_req(pquv, PQUV_NORMAL_STATEMENT, q, NULL, nParams, paramTypes, paramValues, paramLengths, paramFormats, cb,
-              opaque, flags);
+/* puts a request whose cached statement went stale back at the head of the
+ * queue, the statement is prepared again when it is sent */
+static void resend_req(pquv_t* pquv, req_t* r) {
+  PQclear(r->staleRes);
+  r->staleRes = NULL;
+  r->resent = true;
+  r->stmt = NULL;
+  r->stmtReused = false;
+  r->skipResults = 0;
+  r->rowModeSet = false;
+  r->queueDeadline = 0;
+  r->execDeadline = 0;
+  r->sentAt = 0;
+  r->firstResultAt = 0;
+
+  r->next = pquv->queue.head;
+  pquv->queue.head = r;
+  if (pquv->queue.tail == NULL) pquv->queue.tail = r;
+  pquv->queue.length += 1;
 }
 
-void pquv_prepare(pquv_t* pquv, const char* q, const char* name, int nParams, const Oid* paramTypes, req_cb cb,
-                  void* opaque, uint32_t flags) {
-  enqueue_req(pquv, PQUV_PREPARE_STATEMENT, q, name, nParams, paramTypes, NULL, NULL, NULL, cb, opaque, flags);
+static void complete_req(pquv_t* pquv) {
+  req_t* r = dequeue(&pquv->inflight);
+
+  if (r->staleRes != NULL && r->cb != NULL && !r->delivered) {
+    if (can_resend(pquv)) {
+      resend_req(pquv, r);
+      return;
+    }
+
+    r->delivered = true;
+    deliver(pquv, r, r->staleRes);
+    r->staleRes = NULL;
+  }
+
+  if (!r->delivered && r->cb != NULL) {
+    deliver(pquv, r, PQmakeEmptyPGresult(pquv->conn, PGRES_FATAL_ERROR));
+  }
+  free_req(pquv, r);
 }
 
-void pquv_prepared(pquv_t* pquv, const char* name, int nParams, const char* const* paramValues, const int* paramLengths,
-                   const int* paramFormats, req_cb cb, void* opaque, uint32_t flags) {
-  enqueue_req(pquv, PQUV_PREPARED_STATEMENT, NULL, name, nParams, NULL, paramValues, paramLengths, paramFormats, cb,
-              opaque, flags);
+/* errors telling that a cached statement can't be executed anymore: it is
+ * gone, or the tables it reads changed its result type. Other 0A000 errors
+ * come from the execution itself. */
+static bool is_stale_stmt_error(PGresult* res) {
+  if (PQresultStatus(res) != PGRES_FATAL_ERROR) return false;
+
+  const char* sqlstate = PQresultErrorField(res, PG_DIAG_SQLSTATE);
+  if (sqlstate == NULL) return false;
+  if (strcmp(sqlstate, "26000") == 0) return true;
+
+  const char* function = PQresultErrorField(res, PG_DIAG_SOURCE_FUNCTION);
+  return strcmp(sqlstate, "0A000") == 0 && function != NULL && strcmp(function, "RevalidateCachedQuery") == 0;
 }
 
-static void free_req(req_t* r) {
-  if (!(r->flags & PQUV_NON_VOLATILE_NAME_STRING)) GC_FREE((void*)r->name);
+/* hands the rows of COPY TO STDOUT data already received to the sink, returns
+ * false when more data has to be read from the socket first */
+static bool receive_copy_out(pquv_t* pquv, req_t* r) {
+  char* buf;
+  int length;
+
+  while ((length = PQgetCopyData(pquv->conn, &buf, 1)) > 0) {
+    if (r->copyOutCB != NULL) r->copyOutCB(r->opaque, buf, length);
+    PQfreemem(buf);
+  }
+
+  if (length == 0) {
+    return false;
+  }
+
+  /* -1 once the COPY is done, -2 on failure, the final result tells which */
+  r->copyState = PQUV_COPY_DONE;
+  return true;
+}
+
+/* reads every result that is available without blocking and hands it to the
+ * request at the head of the in-flight queue. A request is complete once
+ * libpq signals the end of its results, or in pipeline mode once its sync
+ * point comes back. */
+static void drain_results(pquv_t* pquv) {
+  while (pquv->inflight.head != NULL) {
+    req_t* r = pquv->inflight.head;
+
+    /* the final result of a COPY FROM STDIN comes after all the data */
+    if (r->copyState == PQUV_COPY_STREAMING || r->copyState == PQUV_COPY_ENDING) break;
+
+    if (r->copyState == PQUV_COPY_RECEIVING && !receive_copy_out(pquv, r)) break;
+
+    if (pquv->pipelined) set_row_mode(pquv, r);
+    if (PQisBusy(pquv->conn)) break;
+
+    PGresult* res = PQgetResult(pquv->conn);
+
+    if (res == NULL) {
+      if (!pquv->pipelined) complete_req(pquv);
+      continue;
+    }
+
+#ifdef LIBPQ_HAS_PIPELINING
+    if (PQresultStatus(res) == PGRES_PIPELINE_SYNC) {
+      /* ends the results of a multi statement request */
+      if (r->kind == PQUV_MULTI_STATEMENT && !r->delivered && r->cb != NULL) {
+        r->delivered = true;
+        deliver(pquv, r, res);
+      } else {
+        PQclear(res);
+      }
+      complete_req(pquv);
+      continue;
+    }
+#endif
+
+    if (r->skipResults > 0) {
+      /* a failed Parse step is the result of the request, the execution
+       * that follows it is aborted */
+      r->skipResults -= 1;
+      if (PQresultStatus(res) == PGRES_COMMAND_OK) {
+        PQclear(res);
+      } else {
+        cache_remove(pquv->stmtCache, r->stmt);
+        if (r->delivered || r->cb == NULL) {
+          PQclear(res);
+        } else {
+          r->delivered = true;
+          deliver(pquv, r, res);
+        }
+      }
+      continue;
+    }
+
+    if (r->stmtReused && !r->delivered && r->staleRes == NULL && is_stale_stmt_error(res)) {
+      cache_remove(pquv->stmtCache, r->stmt);
+      if (!r->resent && r->cb != NULL) {
+        r->staleRes = res;
+        continue;
+      }
+    }
+
+    if (PQresultStatus(res) == PGRES_COPY_OUT) {
+      /* the data goes to the sink of the request, a COPY TO STDOUT sent as a
+       * plain query has none and its data is dropped */
+      PQclear(res);
+      r->copyState = PQUV_COPY_RECEIVING;
+      continue;
+    }
+
+    if (PQresultStatus(res) == PGRES_COPY_IN) {
+      PQclear(res);
+      if (r->kind == PQUV_COPY_IN) {
+        r->copyState = PQUV_COPY_STREAMING;
+      } else {
+        /* a COPY FROM STDIN sent as a plain query has no data source */
+        r->copyState = PQUV_COPY_ENDING;
+        r->copyFailed = true;
+      }
+      continue;
+    }
+
+    /* too late to change the row mode once results come in */
+    r->rowModeSet = true;
+
+    if (r->delivered || r->cb == NULL || r->staleRes != NULL) {
+      /* only the first complete result of a request is handed to its
+       * callback */
+      PQclear(res);
+    } else {
+      r->delivered = is_final_result(r, res);
+      deliver(pquv, r, res);
+    }
+  }
+}
+
+static bool is_copying_in(pquv_t* pquv) {
+  req_t* r = pquv->inflight.head;
+  return r != NULL && (r->copyState == PQUV_COPY_STREAMING || r->copyState == PQUV_COPY_ENDING);
+}
+
+/* writes the data of the COPY FROM STDIN in progress for as long as the
+ * socket takes it, returns like `PQflush`: 1 to wait for the socket to be
+ * writable again, 0 once all the data is sent, -1 on failure */
+static int pump_copy_in(pquv_t* pquv) {
+  req_t* r = pquv->inflight.head;
+
+  while (r->copyState == PQUV_COPY_STREAMING) {
+    if (r->copyPending == 0) {
+      int length = r->copyCB(r->opaque, &r->copyBuf);
+      if (length <= 0) {
+        r->copyFailed = length < 0;
+        r->copyState = PQUV_COPY_ENDING;
+        break;
+      }
+      r->copyPending = length;
+    }
+
+    int put = PQputCopyData(pquv->conn, r->copyBuf, r->copyPending);
+    if (put == 0) return 1;
+    if (put < 0) return -1;
+    r->copyPending = 0;
+
+    int flushed = PQflush(pquv->conn);
+    if (flushed != 0) return flushed;
+  }
+
+  if (r->copyState == PQUV_COPY_ENDING) {
+    int ended = PQputCopyEnd(pquv->conn, r->copyFailed ? "COPY aborted by the client" : NULL);
+    if (ended == 0) return 1;
+    if (ended < 0) return -1;
+    r->copyState = PQUV_COPY_DONE;
+    return PQflush(pquv->conn);
+  }
 
-  GC_FREE((void*)r->paramTypes);
-  GC_FREE((void*)r->paramValues);
-  GC_FREE((void*)r->paramLengths);
-  GC_FREE((void*)r->paramFormats);
-  GC_FREE(r);
+  return 0;
 }
 
 static void poll_cb(uv_poll_t* handle, int status, int events) {
@@ -262,8 +1260,17 @@ static void poll_cb(uv_poll_t* handle, int status, int events) {
 
   if (events & UV_WRITABLE) {
     int r = PQflush(pquv->conn);
-    if (r == 0) {
-      if (maybe_send_req(pquv)) {
+    if (r == 0 && is_copying_in(pquv)) {
+      r = pump_copy_in(pquv);
+      if (r == 0) {
+        eventmask &= ~UV_WRITABLE;
+      }
+    } else if (r == 0) {
+      bool sent = maybe_send_req(pquv);
+      /* the connection is being made again, see `reset_connection` */
+      if (pquv->state != PQUV_CONNECTED) return;
+
+      if (sent) {
         r = PQflush(pquv->conn);
         if (r == 0) {
           eventmask &= ~UV_WRITABLE;
@@ -274,7 +1281,10 @@ static void poll_cb(uv_poll_t* handle, int status, int events) {
     }
 
     if (r == -1) {
-      NULL;  // failwith("PQflush failed\n");
+      setError(pquv, PQUV_ERROR_BAD_CONNECTION);
+      fail_pending(pquv);
+      update_poll_eventmask(pquv, UV_DISCONNECT);
+      return;
     } else if (r == 1) {
       eventmask |= UV_READABLE | UV_WRITABLE;
     } else if (r != 0) {
@@ -288,35 +1298,20 @@ static void poll_cb(uv_poll_t* handle, int status, int events) {
         setError(pquv, PQUV_ERROR_BAD_CONNECTION);
       }
 
-      eventmask = UV_DISCONNECT;
-    }
-
-    if (!PQisBusy(pquv->conn)) {
-      if (pquv->live == NULL) {
-        // failwith("received orphan result\n");
-      }
+      fail_pending(pquv);
+      update_poll_eventmask(pquv, UV_DISCONNECT);
+      return;
     }
 
-    PGresult* r = PQgetResult(pquv->conn);
+    /* the oldest request in flight is the one the server answers first */
+    req_t* head = pquv->inflight.head;
+    if (head != NULL && head->firstResultAt == 0) head->firstResultAt = uv_hrtime();
 
-    int res = PQresultStatus(r);
-    if (res != PGRES_TUPLES_OK && res != PGRES_COMMAND_OK && res != PGRES_EMPTY_QUERY) {
-      setError(pquv, PQUV_ERROR_BAD_QUERY);
-    }
+    drain_results(pquv);
 
-    if (pquv->live != NULL) {
-      pquv->live->cb(pquv->live->opaque, r);
-      free_req(pquv->live);
-      pquv->live = NULL;
-    }
-
-    /* TODO: handle more results */
-    if (PQgetResult(pquv->conn) != NULL) {
-      //failwith("bad con");
-    }
-
-    /* if we have enqueued reqs, wait for writeable state */
-    if (pquv->queue.head != NULL) eventmask |= UV_WRITABLE;
+    /* results freed pipeline slots, wait for writeable state to send more */
+    if (pquv->queue.head != NULL && pquv->inflight.length < max_inflight(pquv)) eventmask |= UV_WRITABLE;
+    if (is_copying_in(pquv)) eventmask |= UV_WRITABLE;
   } else {
     /* noop */
   }
@@ -364,6 +1359,7 @@ static void connection_cb(uv_poll_t* handle, int status, int events) {
 }
 
 static void start_connection(pquv_t* pquv);
+static void release_reqs(pquv_t* pquv);
 
 static void start_connection_close_poll_cb(uv_handle_t* h) {
   pquv_t* pquv = container_of(h, pquv_t, poll);
@@ -376,6 +1372,11 @@ static void start_connection_close_poll_cb(uv_handle_t* h) {
   pquv->fd = -1;
   pquv->state = PQUV_NEW;
 
+  if (pquv->alreadyDisconnected) {
+    release_reqs(pquv);
+    return;
+  }
+
   start_connection(pquv);
 }
 
@@ -453,6 +1454,7 @@ static void start_connection(pquv_t* pquv) {
 static void reconnect_timer_cb(uv_timer_t* h) {
   pquv_t* pquv = container_of(h, pquv_t, reconnect_timer);
 
+  pquv->stats->reconnects += 1;
   switch (pquv->state) {
     case PQUV_BAD_RESET:
       if (0 != PQresetStart(pquv->conn)) {
@@ -499,6 +1501,12 @@ static void poll_connection(pquv_t* pquv) {
       cb = connection_cb;
       break;
     case PGRES_POLLING_OK:
+      /* pipelined writes must not block the loop, and a reset leaves the
+       * connection out of pipeline mode */
+      PQsetnonblocking(pquv->conn, 1);
+      cache_clear(pquv->stmtCache);
+      pquv->pipelined = false;
+      set_pipeline_mode(pquv, pquv->pipelineDepth > 1);
       pquv->state = PQUV_CONNECTED;
       pquv->eventmask = events = UV_WRITABLE | UV_READABLE;
       pquv->connectionCB(pquv->connectionOpaque, pquv);
@@ -515,6 +1523,9 @@ static void poll_connection(pquv_t* pquv) {
           // pquv->errMessage = (char*)GC_MALLOC_ATOMIC(errMessageLength + 1);
           // memcpy(pquv->errMessage, errMessage, errMessageLength + 1);
           // pquv->errMessage[errMessageLength] = '\0';
+          /* requests can be queued before the connection is made, they
+           * would otherwise never complete */
+          fail_pending(pquv);
           pquv->connectionCB(pquv->connectionOpaque, pquv);
           return;
         }
@@ -541,30 +1552,419 @@ static void poll_connection(pquv_t* pquv) {
   }
 }
 
-void pquv_init(const char* conninfo, uv_loop_t* loop, void* opaque, init_cb cb) {
+/* Cancel requests go through a connection of their own. With libpq 17 it is
+ * polled from the loop like the main connection, older versions only have
+ * the blocking `PQcancel` which runs on the thread pool. */
+#ifdef LIBPQ_HAS_ASYNC_CANCEL
+
+typedef struct cancel_ts cancel_t;
+
+/* polls a dup of the socket of the cancel connection, see `start_connection`,
+ * the socket can change when several hosts are tried */
+typedef struct {
+  uv_poll_t poll;
+  int socket;
+  int fd;
+  cancel_t* cancel;
+} cancel_watch_t;
+
+struct cancel_ts {
+  pquv_t* pquv;
+  PGcancelConn* conn;
+  cancel_watch_t* watch;
+  int watchers;
+  bool done;
+};
+
+static void finish_cancel(pquv_t* pquv);
+
+static void cancel_watch_close_cb(uv_handle_t* h) {
+  cancel_watch_t* w = container_of(h, cancel_watch_t, poll);
+  cancel_t* c = w->cancel;
+
+  close(w->fd);
+  GC_FREE(w);
+  c->watchers -= 1;
+
+  if (c->done && c->watchers == 0) {
+    PQcancelFinish(c->conn);
+    finish_cancel(c->pquv);
+    GC_FREE(c);
+  }
+}
+
+static void unwatch_cancel(cancel_t* c) {
+  if (c->watch == NULL) return;
+
+  uv_poll_stop(&c->watch->poll);
+  uv_close((uv_handle_t*)&c->watch->poll, cancel_watch_close_cb);
+  c->watch = NULL;
+}
+
+/* whether the cancel went through or not, the query runs to its end */
+static void end_cancel(cancel_t* c) {
+  c->done = true;
+
+  if (c->watchers == 0) {
+    PQcancelFinish(c->conn);
+    finish_cancel(c->pquv);
+    GC_FREE(c);
+  } else {
+    unwatch_cancel(c);
+  }
+}
+
+static void cancel_poll_cb(uv_poll_t* handle, int status, int events);
+
+static void poll_cancel(cancel_t* c, PostgresPollingStatusType polling) {
+  int events;
+
+  switch (polling) {
+    case PGRES_POLLING_READING:
+      events = UV_READABLE;
+      break;
+    case PGRES_POLLING_WRITING:
+      events = UV_WRITABLE;
+      break;
+    default:
+      end_cancel(c);
+      return;
+  }
+
+  int socket = PQcancelSocket(c->conn);
+  if (c->watch != NULL && c->watch->socket != socket) unwatch_cancel(c);
+
+  if (c->watch == NULL) {
+    cancel_watch_t* w = (cancel_watch_t*)GC_MALLOC_UNCOLLECTABLE(sizeof(*w));
+    w->socket = socket;
+    w->fd = socket < 0 ? -1 : fcntl(socket, F_DUPFD_CLOEXEC, 0);
+    w->cancel = c;
+
+    if (w->fd < 0 || uv_poll_init(c->pquv->loop, &w->poll, w->fd) != 0) {
+      if (w->fd >= 0) close(w->fd);
+      GC_FREE(w);
+      end_cancel(c);
+      return;
+    }
+
+    c->watch = w;
+    c->watchers += 1;
+  }
+
+  uv_poll_start(&c->watch->poll, events, cancel_poll_cb);
+}
+
+static void cancel_poll_cb(uv_poll_t* handle, int status, int events) {
+  cancel_watch_t* w = container_of(handle, cancel_watch_t, poll);
+  poll_cancel(w->cancel, status < 0 ? PGRES_POLLING_FAILED : PQcancelPoll(w->cancel->conn));
+}
+
+static bool send_cancel(pquv_t* pquv) {
+  PGcancelConn* conn = PQcancelCreate(pquv->conn);
+  if (conn == NULL) return false;
+
+  if (!PQcancelStart(conn)) {
+    PQcancelFinish(conn);
+    return false;
+  }
+
+  cancel_t* c = (cancel_t*)GC_MALLOC_UNCOLLECTABLE(sizeof(*c));
+  c->pquv = pquv;
+  c->conn = conn;
+  c->watch = NULL;
+  c->watchers = 0;
+  c->done = false;
+  pquv->cancelling += 1;
+  /* as for `PQconnectPoll`, the first step waits for the socket to be
+   * writable */
+  poll_cancel(c, PGRES_POLLING_WRITING);
+  return true;
+}
+
+#else
+
+typedef struct {
+  uv_work_t work;
+  pquv_t* pquv;
+  PGcancel* cancel;
+} cancel_t;
+
+static void finish_cancel(pquv_t* pquv);
+
+static void cancel_work_cb(uv_work_t* work) {
+  cancel_t* c = container_of(work, cancel_t, work);
+  char errbuf[256];
+  /* whether the cancel went through or not, the query runs to its end */
+  PQcancel(c->cancel, errbuf, sizeof(errbuf));
+}
+
+static void cancel_after_work_cb(uv_work_t* work, int status) {
+  cancel_t* c = container_of(work, cancel_t, work);
+  PQfreeCancel(c->cancel);
+  finish_cancel(c->pquv);
+  GC_FREE(c);
+}
+
+static bool send_cancel(pquv_t* pquv) {
+  PGcancel* cancel = PQgetCancel(pquv->conn);
+  if (cancel == NULL) return false;
+
+  cancel_t* c = (cancel_t*)GC_MALLOC_UNCOLLECTABLE(sizeof(*c));
+  c->pquv = pquv;
+  c->cancel = cancel;
+
+  if (uv_queue_work(pquv->loop, &c->work, cancel_work_cb, cancel_after_work_cb) != 0) {
+    PQfreeCancel(cancel);
+    GC_FREE(c);
+    return false;
+  }
+
+  pquv->cancelling += 1;
+  return true;
+}
+
+#endif
+
+/* the requests held back while cancelling can go */
+static void finish_cancel(pquv_t* pquv) {
+  pquv->cancelling -= 1;
+
+  if (pquv->cancelling == 0 && !pquv->alreadyDisconnected && pquv->state == PQUV_CONNECTED &&
+      pquv->queue.head != NULL) {
+    update_poll_eventmask(pquv, pquv->eventmask | UV_WRITABLE);
+  }
+}
+
+/* the server may already run the requests pipelined after `r` when the
+ * cancel arrives, only the ones that are cancelled as well may be hit */
+static bool runs_alone(pquv_t* pquv, req_t* r) {
+  if (r != pquv->inflight.head || r->delivered) return false;
+
+  for (req_t* next = r->next; next != NULL; next = next->next) {
+    if (next->cb != NULL) return false;
+  }
+  return true;
+}
+
+/* drops the results of a request already sent, like the ones of internal
+ * requests, and stops its query when the cancel can only hit that one. A
+ * `timedOut` request running ahead of others is cancelled later, see
+ * `cancel_once_alone`. */
+static void abandon_req(pquv_t* pquv, req_t* r, bool timedOut) {
+  bool running = r == pquv->inflight.head && !r->delivered;
+  bool alone = runs_alone(pquv, r);
+
+  r->cb = NULL;
+  r->copyOutCB = NULL;
+  r->execDeadline = 0;
+
+  if (r->copyState == PQUV_COPY_STREAMING) {
+    /* a COPY FROM STDIN is aborted by the client itself */
+    r->copyState = PQUV_COPY_ENDING;
+    r->copyFailed = true;
+    r->copyPending = 0;
+    update_poll_eventmask(pquv, pquv->eventmask | UV_WRITABLE);
+  } else if (r->copyState != PQUV_COPY_ENDING && pquv->state == PQUV_CONNECTED && alone) {
+    send_cancel(pquv);
+  } else if (r->copyState != PQUV_COPY_ENDING && timedOut && running) {
+    r->cancelOnceAlone = true;
+  }
+}
+
+/* cancels the timed out request running ahead of requests that were since
+ * abandoned as well */
+static void cancel_once_alone(pquv_t* pquv) {
+  req_t* r = pquv->inflight.head;
+  if (r == NULL || !r->cancelOnceAlone || !runs_alone(pquv, r)) return;
+
+  r->cancelOnceAlone = false;
+  if (pquv->state == PQUV_CONNECTED) send_cancel(pquv);
+}
+
+void pquv_cancel(pquv_t* pquv, void* opaque) {
+  if (pquv->alreadyDisconnected) return;
+
+  req_t* prev = NULL;
+  for (req_t* r = pquv->queue.head; r != NULL; prev = r, r = r->next) {
+    if (r->opaque == opaque && r->cb != NULL) {
+      unlink_req(&pquv->queue, prev, r);
+      free_req(pquv, r);
+      return;
+    }
+  }
+
+  for (req_t* r = pquv->inflight.head; r != NULL; r = r->next) {
+    if (r->opaque == opaque && r->cb != NULL) {
+      abandon_req(pquv, r, false);
+      cancel_once_alone(pquv);
+      return;
+    }
+  }
+}
+
+static void deadline_timer_cb(uv_timer_t* h);
+
+/* the timer always fires for the earliest deadline, later ones are picked up
+ * when it does */
+static void arm_deadline(pquv_t* pquv, uint64_t deadline) {
+  if (pquv->alreadyDisconnected || (pquv->nextDeadline != 0 && pquv->nextDeadline <= deadline)) return;
+
+  uint64_t now = uv_now(pquv->loop);
+  pquv->nextDeadline = deadline;
+  uv_timer_start(&pquv->deadline_timer, deadline_timer_cb, deadline > now ? deadline - now : 0, 0);
+}
+
+/* callback of an abandoned request, which stays in flight until its results
+ * are drained */
+typedef struct abandoned_ts {
+  req_cb cb;
+  void* opaque;
+  struct abandoned_ts* next;
+} abandoned_t;
+
+/* Requests past their deadline are failed with a NULL result. Queued ones
+ * are dropped and the ones already sent are abandoned. The running query is
+ * cancelled on the server right away when it runs alone, see `runs_alone`;
+ * otherwise it is marked `cancelOnceAlone` and cancelled once the requests
+ * pipelined behind it are abandoned too, nothing new being sent meanwhile. */
+static void deadline_timer_cb(uv_timer_t* h) {
+  pquv_t* pquv = container_of(h, pquv_t, deadline_timer);
+  uint64_t now = uv_now(pquv->loop);
+  uint64_t next = 0;
+  /* the callbacks run once both queues are walked, they may cancel or send
+   * other requests */
+  queue_t expired = {NULL, NULL, 0};
+  abandoned_t* abandoned = NULL;
+
+  pquv->nextDeadline = 0;
+
+  req_t* prev = NULL;
+  req_t* r = pquv->queue.head;
+  while (r != NULL) {
+    req_t* following = r->next;
+
+    if (r->queueDeadline != 0 && r->queueDeadline <= now) {
+      unlink_req(&pquv->queue, prev, r);
+      enqueue(&expired, r);
+    } else {
+      if (r->queueDeadline != 0 && (next == 0 || r->queueDeadline < next)) next = r->queueDeadline;
+      prev = r;
+    }
+
+    r = following;
+  }
+
+  for (r = pquv->inflight.head; r != NULL; r = r->next) {
+    if (r->execDeadline == 0 || r->cb == NULL) continue;
+
+    if (r->execDeadline > now) {
+      if (next == 0 || r->execDeadline < next) next = r->execDeadline;
+      continue;
+    }
+
+    if (!r->delivered) {
+      abandoned_t* a = (abandoned_t*)GC_MALLOC_UNCOLLECTABLE(sizeof(*a));
+      a->cb = r->cb;
+      a->opaque = r->opaque;
+      a->next = abandoned;
+      abandoned = a;
+    }
+    abandon_req(pquv, r, true);
+  }
+
+  cancel_once_alone(pquv);
+
+  if (next != 0) arm_deadline(pquv, next);
+
+  while ((r = dequeue(&expired)) != NULL) {
+    if (r->cb != NULL) deliver(pquv, r, NULL);
+    free_req(pquv, r);
+  }
+
+  while (abandoned != NULL) {
+    abandoned_t* a = abandoned;
+    abandoned = a->next;
+    record_result(pquv, NULL, NULL, 0);
+    a->cb(a->opaque, NULL);
+    GC_FREE(a);
+  }
+}
+
+void pquv_set_queue_limits(pquv_t* connection, int maxQueueLength, size_t maxPendingBytes) {
+  connection->maxQueueLength = maxQueueLength < 0 ? 0 : maxQueueLength;
+  connection->maxPendingBytes = maxPendingBytes;
+}
+
+void pquv_set_timeouts(pquv_t* connection, int queueTimeoutMs, int execTimeoutMs) {
+  connection->queueTimeoutMs = queueTimeoutMs < 0 ? 0 : queueTimeoutMs;
+  connection->execTimeoutMs = execTimeoutMs < 0 ? 0 : execTimeoutMs;
+}
+
+pquv_t* pquv_init(const char* conninfo, uv_loop_t* loop, void* opaque, init_cb cb) {
   pquv_t* pquv = (pquv_t*)GC_MALLOC(sizeof(*pquv));
 
   pquv->loop = loop;
   pquv->conninfo = strndup(conninfo, MAX_CONNINFO_LENGTH);
   pquv->queue.head = NULL;
   pquv->queue.tail = NULL;
+  pquv->queue.length = 0;
+  pquv->inflight.head = NULL;
+  pquv->inflight.tail = NULL;
+  pquv->inflight.length = 0;
+  pquv->pipelineDepth = PQUV_DEFAULT_PIPELINE_DEPTH;
+  pquv->pipelined = false;
+  pquv->stmtCache = (stmt_cache_t*)GC_MALLOC(sizeof(stmt_cache_t));
+  pquv->stmtCache->capacity = PQUV_DEFAULT_STATEMENT_CACHE_SIZE;
   pquv->reconnect_timer_ms = 1000;
   pquv->state = PQUV_NEW;
   pquv->fd = -1;
   pquv->eventmask = 0;
-  pquv->live = NULL;
   pquv->err = PQUV_ERROR_NONE;
   pquv->errMessage = (char*)"";
   pquv->connectionCB = cb;
   pquv->connectionOpaque = opaque;
   pquv->alreadyDisconnected = false;
+  pquv->cancelling = 0;
+  pquv->queueTimeoutMs = 0;
+  pquv->execTimeoutMs = 0;
+  pquv->nextDeadline = 0;
+  pquv->maxQueueLength = 0;
+  pquv->maxPendingBytes = 0;
+  pquv->pendingBytes = 0;
+  pquv->freeReqs = NULL;
+  pquv->freeReqsLength = 0;
+  /* no pointers in there for the collector to scan */
+  pquv->stats = (pquv_stats_t*)GC_MALLOC_ATOMIC(sizeof(pquv_stats_t));
+  memset(pquv->stats, 0, sizeof(pquv_stats_t));
 
   int r;
   if ((r = uv_timer_init(loop, &pquv->reconnect_timer)) != 0) {
     setError(pquv, PQUV_ERROR_BAD_CONNECTION);
   }
+  if ((r = uv_timer_init(loop, &pquv->deadline_timer)) != 0) {
+    setError(pquv, PQUV_ERROR_BAD_CONNECTION);
+  }
+  /* pending requests keep the loop alive, deadlines alone must not */
+  uv_unref((uv_handle_t*)&pquv->deadline_timer);
 
   start_connection(pquv);
+  return pquv;
+}
+
+/* fails the requests of a connection that is gone, the ones their
+ * callbacks send fail as well, then frees the free list. The connection may
+ * be finished already, the error result doesn't come from it. */
+static void release_reqs(pquv_t* pquv) {
+  req_t* r;
+  while ((r = dequeue(&pquv->inflight)) != NULL || (r = dequeue(&pquv->queue)) != NULL) {
+    if (!r->delivered && r->cb != NULL) deliver(pquv, r, PQmakeEmptyPGresult(NULL, PGRES_FATAL_ERROR));
+    free_req(pquv, r);
+  }
+  while ((r = pquv->freeReqs) != NULL) {
+    pquv->freeReqs = r->next;
+    GC_FREE(r);
+  }
+  pquv->freeReqsLength = 0;
 }
 
 static void pquv_free_close_poll_cb(uv_handle_t* h) {
@@ -575,36 +1975,36 @@ static void pquv_free_close_poll_cb(uv_handle_t* h) {
   }
 
   PQfinish(pquv->conn);
-
-  if (pquv->live != NULL) free_req(pquv->live);
-
-  req_t* r = pquv->queue.head;
-  while (r != NULL) {
-    req_t* n = r->next;
-    free_req(r);
-    r = n;
-  }
+  release_reqs(pquv);
 
   // GC_FREE(pquv);
 }
 
+/* the poll can be stopped, after `reset_connection`, or already closing when
+ * the connection is being made again, see `start_connection_close_poll_cb` */
 static void pquv_close_timer_cb(uv_handle_t* h) {
   pquv_t* pquv = container_of(h, pquv_t, reconnect_timer);
 
-  //   if (pquv && pquv->poll.u.fd != 0) {
-  if (uv_is_active((uv_handle_t*)&pquv->poll)) {
+  if (pquv->fd >= 0 && !uv_is_closing((uv_handle_t*)&pquv->poll)) {
     int r;
     if ((r = uv_poll_stop(&pquv->poll)) != 0) {
       NULL;  // failwith("uv_poll_stop: %s\n", uv_strerror(r));
     }
     uv_close((uv_handle_t*)&pquv->poll, pquv_free_close_poll_cb);
-  } else {
-    // GC_FREE(pquv);
+  } else if (pquv->fd < 0) {
+    /* the connection never got a socket to poll */
+    PQfinish(pquv->conn);
+    release_reqs(pquv);
   }
 }
 
+/* the pending requests fail once the handles are closed, see
+ * `release_reqs`, the callbacks being run may still use them */
 void pquv_free(pquv_t* pquv) {
+  if (pquv->alreadyDisconnected) return;
+
   pquv->alreadyDisconnected = true;
+  uv_close((uv_handle_t*)&pquv->deadline_timer, NULL);
   uv_close((uv_handle_t*)&pquv->reconnect_timer, pquv_close_timer_cb);
 }
 
@@ -618,4 +2018,55 @@ int pquv_get_error(pquv_t* connection) {
 
 bool pquv_get_disconnected(pquv_t* connection) { return connection->alreadyDisconnected; }
 
+int pquv_get_pending(pquv_t* connection) { return connection->queue.length + connection->inflight.length; }
+
+bool pquv_get_connected(pquv_t* connection) { return connection->state == PQUV_CONNECTED; }
+
+void pquv_set_statement_cache_size(pquv_t* connection, int size) {
+  /* statements above the new size are evicted when the next one is
+   * prepared */
+  connection->stmtCache->capacity = size < 0 ? 0 : size;
+}
+
+void pquv_set_pipeline_depth(pquv_t* connection, int depth) {
+  connection->pipelineDepth = depth < 1 ? 1 : depth;
+}
+
 char* pquv_get_errorMessage(pquv_t* connection) { return connection->errMessage; }
+
+void pquv_get_stats(pquv_t* connection, pquv_stats_t* stats) { memcpy(stats, connection->stats, sizeof(*stats)); }
+
+void pquv_merge_stats(pquv_stats_t* into, const pquv_stats_t* from) {
+  into->queries += from->queries;
+  into->errors += from->errors;
+  into->timeouts += from->timeouts;
+  into->rejected += from->rejected;
+  into->rows += from->rows;
+  into->bytesSent += from->bytesSent;
+  into->reconnects += from->reconnects;
+  histogram_merge(&into->queued, &from->queued);
+  histogram_merge(&into->server, &from->server);
+  histogram_merge(&into->transfer, &from->transfer);
+  histogram_merge(&into->decode, &from->decode);
+  histogram_merge(&into->total, &from->total);
+}
+
+void pquv_result_decoded(void) {
+  if (decodingConn == NULL) return;
+
+  histogram_record(&decodingConn->stats->decode, elapsed_us(decodingSince, uv_hrtime()));
+  /* only the first call of a callback counts */
+  decodingConn = NULL;
+}
+
+pquv_deferred_t pquv_result_deferred(void) {
+  pquv_deferred_t deferred = {decodingConn, decodingSince};
+  decodingConn = NULL;
+  return deferred;
+}
+
+void pquv_deferred_decoded(pquv_deferred_t deferred) {
+  if (deferred.connection == NULL) return;
+
+  histogram_record(&deferred.connection->stats->decode, elapsed_us(deferred.since, uv_hrtime()));
+}
@@ -1,36 +1,142 @@
 #pragma once
 
+#include "histogram.hpp"
 #include "libpq-fe.h"
 #include "uv.h"
 
 struct pquv_st;
 typedef struct pquv_st pquv_t;
 
-/* its up to the receiver of the callback to call PQclear on `res` */
+/* its up to the receiver of the callback to call PQclear on `res`, which is
+ * NULL when the request timed out, see `pquv_set_timeouts` */
 typedef void (*req_cb)(void* opaque, PGresult* res);
 typedef void (*init_cb)(void* opaque, pquv_t* connection);
+/* stores the next chunk of COPY data in `*buf` and returns its length, 0 when
+ * all the data was given or -1 to abort the COPY. The chunk must stay valid
+ * until the next call. */
+typedef int (*copy_in_cb)(void* opaque, const char** buf);
+/* receives a row of COPY data, `buf` is only valid during the call */
+typedef void (*copy_out_cb)(void* opaque, const char* buf, int length);
 
 
 #define MAX_CONNINFO_LENGTH 1048
-void pquv_init(const char* conninfo, uv_loop_t* loop, void *opaque, init_cb cb);
+/* `cb` may be called before `pquv_init` returns when the connection fails
+ * right away */
+pquv_t* pquv_init(const char* conninfo, uv_loop_t* loop, void *opaque, init_cb cb);
+/* closes the connection, the requests still waiting for a result fail with
+ * a connection error on a later turn of the loop */
 void pquv_free(pquv_t* pquv);
 
 int pquv_get_error(pquv_t *connection);
 char *pquv_get_errorMessage(pquv_t *connection);
 
 bool pquv_get_disconnected(pquv_t *connection);
+bool pquv_get_connected(pquv_t *connection);
+
+/* number of requests queued or waiting for their results */
+int pquv_get_pending(pquv_t *connection);
+
+enum pquv_error_t {
+  PQUV_ERROR_NONE = 0,
+  PQUV_ERROR_BAD_CONNECTION,
+  PQUV_ERROR_BAD_QUERY,
+  PQUV_ERROR_TIMEOUT,
+  PQUV_ERROR_OVERLOADED,
+};
+
+/* maximum number of requests sent to the server before their results are
+ * received. With a depth greater than 1 the connection runs in libpq's
+ * pipeline mode and every request is followed by its own sync point, so a
+ * failing request does not abort the ones pipelined after it. A depth of 1
+ * sends one request at a time. */
+#define PQUV_DEFAULT_PIPELINE_DEPTH 64
+void pquv_set_pipeline_depth(pquv_t *connection, int depth);
+
+/* maximum number of statements kept prepared by requests sent with
+ * `PQUV_CACHE_STATEMENT`, the least recently used one is deallocated when
+ * a new one does not fit */
+#define PQUV_DEFAULT_STATEMENT_CACHE_SIZE 256
+void pquv_set_statement_cache_size(pquv_t *connection, int size);
+
+/* limits, in ms, the time requests sent from now on may wait in the queue and
+ * then run once sent, 0 for no limit which is the default. A request past its
+ * deadline gets a NULL result right away. Its query is cancelled on the
+ * server when it is the one running and no other request is pipelined
+ * behind it, as the cancel could hit that one instead. Otherwise nothing new
+ * is sent, and it is cancelled once the requests behind it time out or are
+ * cancelled too. Until then, or for good when they don't, it runs to its end
+ * on the server. */
+void pquv_set_timeouts(pquv_t *connection, int queueTimeoutMs, int execTimeoutMs);
+
+/* Counters since the connection was opened, and histograms of the time in µs
+ * requests spend in each stage:
+ *   queued    from being queued to being sent
+ *   server    from being sent to their first result
+ *   transfer  from their first result to their complete one
+ *   decode    from their complete result to `pquv_result_decoded`
+ *   total     from being queued to their complete result
+ * Requests that time out are only counted, they have no durations.
+ */
+typedef struct {
+  /* requests completed, including the failed ones */
+  uint64_t queries;
+  uint64_t errors;
+  uint64_t timeouts;
+  /* requests turned down by the queue limits */
+  uint64_t rejected;
+  uint64_t rows;
+  /* query text and parameters sent */
+  uint64_t bytesSent;
+  uint64_t reconnects;
+  histogram_t queued;
+  histogram_t server;
+  histogram_t transfer;
+  histogram_t decode;
+  histogram_t total;
+} pquv_stats_t;
+
+/* copies the current stats of the connection to `stats` */
+void pquv_get_stats(pquv_t *connection, pquv_stats_t *stats);
+/* adds the stats of `from` to `into` */
+void pquv_merge_stats(pquv_stats_t *into, const pquv_stats_t *from);
+
+/* called by a request callback once it is done with the result it was given,
+ * records the decode time of the request, does nothing outside a callback */
+void pquv_result_decoded(void);
+
+/* a result the request callback decodes after returning, see
+ * `pquv_result_deferred` */
+typedef struct {
+  pquv_t *connection;
+  uint64_t since;
+} pquv_deferred_t;
+
+/* called by a request callback instead of `pquv_result_decoded` when it
+ * decodes the result later, which `pquv_deferred_decoded` then records */
+pquv_deferred_t pquv_result_deferred(void);
+void pquv_deferred_decoded(pquv_deferred_t deferred);
 
 
-#define MAX_QUERY_LENGTH 2048
 #define MAX_NAME_LENGTH 512
 
+/* Turns down requests once `maxQueueLength` requests wait to be sent, or once
+ * the queries and parameters of the requests pending on the connection take
+ * `maxPendingBytes`, 0 for no limit which is the default. A connection with
+ * nothing pending takes any request.
+ */
+void pquv_set_queue_limits(pquv_t *connection, int maxQueueLength, size_t maxPendingBytes);
+
 /* pre-condition: the pointers contained in the `paramValues`
  * array are assumed to be valid until the call to `cb`,
  * the actual array however needs only to be valid until the
  * return of the corresponding function call.
+ *
+ * The functions sending requests return PQUV_ERROR_OVERLOADED, without
+ * calling `cb`, when the request is turned down, see
+ * `pquv_set_queue_limits`, and PQUV_ERROR_NONE otherwise.
  */
 
-void pquv_query_params(
+int pquv_query_params(
         pquv_t* pquv,
         const char* q,
         int nParams,
@@ -41,7 +147,70 @@ void pquv_query_params(
         req_cb cb, void* opaque,
         uint32_t flags);
 
-void pquv_prepare(
+/* same as `pquv_query_params` but rows are handed to `cb` as they arrive,
+ * in PGRES_SINGLE_TUPLE results, or with a libpq supporting chunked rows in
+ * PGRES_TUPLES_CHUNK results of up to `chunkSize` rows. The last call
+ * receives the final PGRES_TUPLES_OK result, without rows, or the error
+ * that ended the query.
+ */
+int pquv_query_stream(
+        pquv_t* pquv,
+        const char* q,
+        int nParams,
+        const Oid* paramTypes,
+        const char* const* paramValues,
+        const int* paramLengths,
+        const int* paramFormats,
+        int chunkSize,
+        req_cb cb, void* opaque,
+        uint32_t flags);
+
+/* runs the statements of `q`, separated by semicolons, in one round trip and
+ * in one implicit transaction like a simple query does, a failing statement
+ * aborts the ones after it. `cb` receives the result of each statement, the
+ * ones aborted get PGRES_PIPELINE_ABORTED results, and then a
+ * PGRES_PIPELINE_SYNC result once all are in. Requires a libpq supporting
+ * pipeline mode, the request fails otherwise.
+ */
+int pquv_query_multi(
+        pquv_t* pquv,
+        const char* q,
+        req_cb cb, void* opaque,
+        uint32_t flags);
+
+/* runs the COPY FROM STDIN statement `q` and sends the data given by
+ * `dataCB` as fast as the socket takes it, `cb` receives the final result.
+ * COPY can't be pipelined so the request waits for the requests sent before
+ * it to complete and the ones after it wait for the COPY to complete.
+ */
+int pquv_copy_in(
+        pquv_t* pquv,
+        const char* q,
+        copy_in_cb dataCB,
+        req_cb cb, void* opaque,
+        uint32_t flags);
+
+/* runs the COPY TO STDOUT statement `q`, the data is handed to `dataCB` as
+ * it is read from the socket and `cb` receives the final result. Like
+ * `pquv_copy_in` the request is never pipelined.
+ */
+int pquv_copy_out(
+        pquv_t* pquv,
+        const char* q,
+        copy_out_cb dataCB,
+        req_cb cb, void* opaque,
+        uint32_t flags);
+
+/* Cancels the request sent with `opaque`, its callback won't be called. A
+ * request still queued is dropped. The results of one already sent are
+ * dropped as they arrive, and when its query is the one running on the server
+ * a cancel request is sent, unless requests pipelined after it could be hit
+ * instead. Requests wait for the cancel request to complete before being
+ * sent. Unknown or completed requests are ignored.
+ */
+void pquv_cancel(pquv_t* pquv, void* opaque);
+
+int pquv_prepare(
         pquv_t* pquv,
         const char* q,
         const char* name,
@@ -50,7 +219,7 @@ void pquv_prepare(
         req_cb cb, void* opaque,
         uint32_t flags);
 
-void pquv_prepared(
+int pquv_prepared(
         pquv_t* pquv,
         const char* name,
         int nParams,
@@ -61,16 +230,25 @@ void pquv_prepared(
         uint32_t flags);
 
 /* the query string given to `pquv_query_params` is guaranteed to be accessible
- * until the callback is called */
+ * until the callback is called, it is copied otherwise */
 #define PQUV_NON_VOLATILE_QUERY_STRING 0x00000001
 /* the name string given to `pquv_prepare` is guaranteed to be accessible
  * until the callback is called */
 #define PQUV_NON_VOLATILE_NAME_STRING  0x00000002
+/* the query given to `pquv_query_params` is prepared under a generated name
+ * the first time it is sent with the same parameter types and only bound
+ * and executed afterwards, requires pipeline mode. A cached statement the
+ * server no longer accepts, after a schema change for instance, is prepared
+ * again and the request sent once more, unless it ran in a transaction or
+ * requests were pipelined after it: the error is the result then. */
+#define PQUV_CACHE_STATEMENT           0x00000004
+/* set by `pquv_query_stream` */
+#define PQUV_SINGLE_ROW                0x00000008
 
-static inline void pquv_query(
+static inline int pquv_query(
         pquv_t* pquv,
         const char* q,
         req_cb cb, void* opaque)
 {
-    pquv_query_params(pquv, q, 0, NULL, NULL, NULL, NULL, cb, opaque, 0);
+    return pquv_query_params(pquv, q, 0, NULL, NULL, NULL, NULL, cb, opaque, 0);
 }
\ No newline at end of file
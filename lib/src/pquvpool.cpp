@@ -0,0 +1,316 @@
+#include "pquvpool.hpp"
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "gc.h"
+#include "libpq-fe.h"
+#include "pquvutils.hpp"
+#include "uv.h"
+
+enum pool_conn_state_t {
+  POOL_CONN_FREE = 0,
+  POOL_CONN_CONNECTING,
+  POOL_CONN_READY,
+};
+
+struct pool_conn_st {
+  pquv_pool_t* pool;
+  pquv_t* pquv;
+  enum pool_conn_state_t state;
+  uint64_t lastUsed;
+};
+typedef struct pool_conn_st pool_conn_t;
+
+struct pquv_pool_st {
+  uv_loop_t* loop;
+  uv_timer_t reap_timer;
+  char* conninfo;
+  int minSize;
+  int maxSize;
+  int idleTimeoutMs;
+  int queueTimeoutMs;
+  int execTimeoutMs;
+  int maxQueueLength;
+  size_t maxPendingBytes;
+  /* stats of the connections already closed */
+  pquv_stats_t* retiredStats;
+  pool_conn_t* conns;
+  bool initialized;
+  bool alreadyDisconnected;
+  int err;
+  char* errMessage;
+  pool_init_cb initCB;
+  void* initOpaque;
+};
+
+static int count_open(pquv_pool_t* pool) {
+  int open = 0;
+  for (int i = 0; i < pool->maxSize; i++) {
+    if (pool->conns[i].state != POOL_CONN_FREE) open += 1;
+  }
+  return open;
+}
+
+/* the requests still pending on the connection fail once it is closed,
+ * their callbacks can send new requests, which go to the other connections */
+static void release_conn(pool_conn_t* c) {
+  pquv_t* pquv = c->pquv;
+  pquv_stats_t stats;
+  pquv_get_stats(pquv, &stats);
+  pquv_merge_stats(c->pool->retiredStats, &stats);
+
+  c->pquv = NULL;
+  c->state = POOL_CONN_FREE;
+  pquv_free(pquv);
+}
+
+static void setError(pquv_pool_t* pool, pquv_t* pquv) {
+  char* errMessage = pquv_get_errorMessage(pquv);
+  size_t errMessageLength = strlen(errMessage);
+  pool->err = pquv_get_error(pquv);
+  pool->errMessage = (char*)GC_MALLOC_ATOMIC(errMessageLength + 1);
+  memcpy(pool->errMessage, errMessage, errMessageLength + 1);
+}
+
+static void connection_cb(void* opaque, pquv_t* pquv) {
+  pool_conn_t* c = (pool_conn_t*)opaque;
+  pquv_pool_t* pool = c->pool;
+  c->pquv = pquv;
+
+  if (pool->alreadyDisconnected) {
+    release_conn(c);
+    return;
+  }
+
+  if (pquv_get_error(pquv) != PQUV_ERROR_NONE) {
+    setError(pool, pquv);
+    release_conn(c);
+
+    if (!pool->initialized && count_open(pool) == 0) {
+      pool->initialized = true;
+      pool->initCB(pool->initOpaque, pool);
+    }
+    return;
+  }
+
+  c->state = POOL_CONN_READY;
+  c->lastUsed = uv_now(pool->loop);
+  pool->err = PQUV_ERROR_NONE;
+
+  if (!pool->initialized) {
+    pool->initialized = true;
+    pool->initCB(pool->initOpaque, pool);
+  }
+}
+
+static pool_conn_t* spawn_conn(pquv_pool_t* pool) {
+  for (int i = 0; i < pool->maxSize; i++) {
+    pool_conn_t* c = &pool->conns[i];
+    if (c->state == POOL_CONN_FREE) {
+      c->state = POOL_CONN_CONNECTING;
+      c->lastUsed = uv_now(pool->loop);
+      pquv_t* pquv = pquv_init(pool->conninfo, pool->loop, c, connection_cb);
+
+      /* the connection can fail before `pquv_init` returns, in which case
+       * the slot has already been released */
+      if (c->state == POOL_CONN_FREE) return NULL;
+      c->pquv = pquv;
+      pquv_set_timeouts(pquv, pool->queueTimeoutMs, pool->execTimeoutMs);
+      pquv_set_queue_limits(pquv, pool->maxQueueLength, pool->maxPendingBytes);
+      return c;
+    }
+  }
+
+  return NULL;
+}
+
+/* ready connections are preferred over connecting ones, then the one with
+ * the fewest pending requests wins */
+static bool is_better(pool_conn_t* a, pool_conn_t* b) {
+  if (a->state != b->state) return a->state == POOL_CONN_READY;
+  return pquv_get_pending(a->pquv) < pquv_get_pending(b->pquv);
+}
+
+static pool_conn_t* pick_conn(pquv_pool_t* pool) {
+  pool_conn_t* best = NULL;
+  bool connecting = false;
+  int open = 0;
+
+  for (int i = 0; i < pool->maxSize; i++) {
+    pool_conn_t* c = &pool->conns[i];
+    if (c->state == POOL_CONN_FREE) continue;
+
+    if (c->state == POOL_CONN_READY && pquv_get_error(c->pquv) != PQUV_ERROR_NONE) {
+      setError(pool, c->pquv);
+      release_conn(c);
+      continue;
+    }
+
+    open += 1;
+    connecting |= c->state == POOL_CONN_CONNECTING;
+    if (best == NULL || is_better(c, best)) best = c;
+  }
+
+  bool idle = best != NULL && best->state == POOL_CONN_READY && pquv_get_pending(best->pquv) == 0;
+
+  /* every open connection is busy: grow the pool, one connection at a time,
+   * the request still goes to the least loaded connection */
+  if (!idle && !connecting && open < pool->maxSize && !pool->alreadyDisconnected) {
+    pool_conn_t* spawned = spawn_conn(pool);
+    if (best == NULL) best = spawned;
+  }
+
+  return best;
+}
+
+static void reap_timer_cb(uv_timer_t* h) {
+  pquv_pool_t* pool = container_of(h, pquv_pool_t, reap_timer);
+  uint64_t now = uv_now(pool->loop);
+  int open = count_open(pool);
+
+  for (int i = 0; i < pool->maxSize && open > pool->minSize; i++) {
+    pool_conn_t* c = &pool->conns[i];
+    if (c->state == POOL_CONN_READY && pquv_get_pending(c->pquv) == 0 &&
+        now - c->lastUsed >= (uint64_t)pool->idleTimeoutMs) {
+      release_conn(c);
+      open -= 1;
+    }
+  }
+
+  /* replace the connections that were lost */
+  while (open < pool->minSize && spawn_conn(pool) != NULL) {
+    open += 1;
+  }
+}
+
+pquv_pool_t* pquv_pool_init(const char* conninfo, uv_loop_t* loop, int minSize, int maxSize, int idleTimeoutMs,
+                            void* opaque, pool_init_cb cb) {
+  pquv_pool_t* pool = (pquv_pool_t*)GC_MALLOC(sizeof(*pool));
+
+  if (maxSize < 1) maxSize = 1;
+  if (minSize < 1) minSize = 1;
+  if (minSize > maxSize) minSize = maxSize;
+
+  pool->loop = loop;
+  pool->conninfo = strndup(conninfo, MAX_CONNINFO_LENGTH);
+  pool->minSize = minSize;
+  pool->maxSize = maxSize;
+  pool->idleTimeoutMs = idleTimeoutMs;
+  pool->queueTimeoutMs = 0;
+  pool->execTimeoutMs = 0;
+  pool->maxQueueLength = 0;
+  pool->maxPendingBytes = 0;
+  pool->retiredStats = (pquv_stats_t*)GC_MALLOC_ATOMIC(sizeof(pquv_stats_t));
+  memset(pool->retiredStats, 0, sizeof(pquv_stats_t));
+  pool->conns = (pool_conn_t*)GC_MALLOC(sizeof(pool_conn_t) * maxSize);
+  pool->initialized = false;
+  pool->alreadyDisconnected = false;
+  pool->err = PQUV_ERROR_NONE;
+  pool->errMessage = (char*)"";
+  pool->initCB = cb;
+  pool->initOpaque = opaque;
+
+  for (int i = 0; i < maxSize; i++) {
+    pool->conns[i].pool = pool;
+    pool->conns[i].pquv = NULL;
+    pool->conns[i].state = POOL_CONN_FREE;
+  }
+
+  if (uv_timer_init(loop, &pool->reap_timer) == 0) {
+    uv_timer_start(&pool->reap_timer, reap_timer_cb, idleTimeoutMs, idleTimeoutMs);
+    /* the reaper alone must not keep the loop alive */
+    uv_unref((uv_handle_t*)&pool->reap_timer);
+  }
+
+  for (int i = 0; i < minSize; i++) {
+    spawn_conn(pool);
+  }
+
+  return pool;
+}
+
+void pquv_pool_free(pquv_pool_t* pool) {
+  pool->alreadyDisconnected = true;
+
+  for (int i = 0; i < pool->maxSize; i++) {
+    pool_conn_t* c = &pool->conns[i];
+    /* connecting ones are released from `connection_cb` */
+    if (c->state == POOL_CONN_READY) release_conn(c);
+  }
+
+  uv_timer_stop(&pool->reap_timer);
+  uv_close((uv_handle_t*)&pool->reap_timer, NULL);
+}
+
+int pquv_pool_query_params(pquv_pool_t* pool, const char* q, int nParams, const Oid* paramTypes,
+                           const char* const* paramValues, const int* paramLengths, const int* paramFormats, req_cb cb,
+                           void* opaque, uint32_t flags) {
+  pool_conn_t* c = pick_conn(pool);
+
+  if (c == NULL) {
+    return PQUV_ERROR_BAD_CONNECTION;
+  }
+
+  c->lastUsed = uv_now(pool->loop);
+  return pquv_query_params(c->pquv, q, nParams, paramTypes, paramValues, paramLengths, paramFormats, cb, opaque,
+                           flags);
+}
+
+void pquv_pool_set_queue_limits(pquv_pool_t* pool, int maxQueueLength, size_t maxPendingBytes) {
+  pool->maxQueueLength = maxQueueLength;
+  pool->maxPendingBytes = maxPendingBytes;
+
+  for (int i = 0; i < pool->maxSize; i++) {
+    pool_conn_t* c = &pool->conns[i];
+    if (c->state != POOL_CONN_FREE && c->pquv != NULL) pquv_set_queue_limits(c->pquv, maxQueueLength, maxPendingBytes);
+  }
+}
+
+int pquv_pool_get_pending(pquv_pool_t* pool) {
+  int pending = 0;
+
+  for (int i = 0; i < pool->maxSize; i++) {
+    pool_conn_t* c = &pool->conns[i];
+    if (c->state != POOL_CONN_FREE && c->pquv != NULL) pending += pquv_get_pending(c->pquv);
+  }
+  return pending;
+}
+
+void pquv_pool_get_stats(pquv_pool_t* pool, pquv_stats_t* stats) {
+  memcpy(stats, pool->retiredStats, sizeof(*stats));
+
+  for (int i = 0; i < pool->maxSize; i++) {
+    pool_conn_t* c = &pool->conns[i];
+    if (c->state != POOL_CONN_FREE && c->pquv != NULL) {
+      pquv_stats_t connStats;
+      pquv_get_stats(c->pquv, &connStats);
+      pquv_merge_stats(stats, &connStats);
+    }
+  }
+}
+
+void pquv_pool_set_timeouts(pquv_pool_t* pool, int queueTimeoutMs, int execTimeoutMs) {
+  pool->queueTimeoutMs = queueTimeoutMs;
+  pool->execTimeoutMs = execTimeoutMs;
+
+  for (int i = 0; i < pool->maxSize; i++) {
+    pool_conn_t* c = &pool->conns[i];
+    if (c->state != POOL_CONN_FREE && c->pquv != NULL) pquv_set_timeouts(c->pquv, queueTimeoutMs, execTimeoutMs);
+  }
+}
+
+void pquv_pool_cancel(pquv_pool_t* pool, void* opaque) {
+  for (int i = 0; i < pool->maxSize; i++) {
+    pool_conn_t* c = &pool->conns[i];
+    if (c->state != POOL_CONN_FREE && c->pquv != NULL) pquv_cancel(c->pquv, opaque);
+  }
+}
+
+int pquv_pool_get_error(pquv_pool_t* pool) { return pool->err; }
+
+char* pquv_pool_get_errorMessage(pquv_pool_t* pool) { return pool->errMessage; }
+
+bool pquv_pool_get_disconnected(pquv_pool_t* pool) { return pool->alreadyDisconnected; }
+
+int pquv_pool_get_size(pquv_pool_t* pool) { return count_open(pool); }
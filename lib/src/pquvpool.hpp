@@ -0,0 +1,74 @@
+#pragma once
+
+#include "pquv.hpp"
+
+struct pquv_pool_st;
+typedef struct pquv_pool_st pquv_pool_t;
+
+/* called once, when the first connection of the pool is established or when
+ * all the initial connections failed, see `pquv_pool_get_error` */
+typedef void (*pool_init_cb)(void* opaque, pquv_pool_t* pool);
+
+
+#define PQUV_POOL_DEFAULT_IDLE_TIMEOUT_MS 30000
+
+/* Creates a pool owning between `minSize` and `maxSize` connections.
+ * `minSize` connections are opened right away, more are opened lazily when
+ * all the open ones are busy. Connections above `minSize` that stayed idle
+ * for `idleTimeoutMs` are closed. Freeing the pool before `cb` is called
+ * drops the call.
+ */
+pquv_pool_t* pquv_pool_init(
+        const char* conninfo,
+        uv_loop_t* loop,
+        int minSize,
+        int maxSize,
+        int idleTimeoutMs,
+        void* opaque,
+        pool_init_cb cb);
+void pquv_pool_free(pquv_pool_t* pool);
+
+int pquv_pool_get_error(pquv_pool_t* pool);
+char* pquv_pool_get_errorMessage(pquv_pool_t* pool);
+bool pquv_pool_get_disconnected(pquv_pool_t* pool);
+int pquv_pool_get_size(pquv_pool_t* pool);
+
+/* same contract as `pquv_query_params`, the request is sent on the idle
+ * connection or the one with the fewest pending requests. Returns
+ * `PQUV_ERROR_BAD_CONNECTION` without calling `cb` when no connection could
+ * be opened, see `pquv_pool_get_errorMessage`. */
+int pquv_pool_query_params(
+        pquv_pool_t* pool,
+        const char* q,
+        int nParams,
+        const Oid* paramTypes,
+        const char* const* paramValues,
+        const int* paramLengths,
+        const int* paramFormats,
+        req_cb cb, void* opaque,
+        uint32_t flags);
+
+/* same as `pquv_set_queue_limits` for each connection, for the open
+ * connections and the ones opened later */
+void pquv_pool_set_queue_limits(pquv_pool_t* pool, int maxQueueLength, size_t maxPendingBytes);
+
+/* requests pending on all the connections of the pool */
+int pquv_pool_get_pending(pquv_pool_t* pool);
+
+/* the stats of all the connections the pool opened, closed ones included */
+void pquv_pool_get_stats(pquv_pool_t* pool, pquv_stats_t* stats);
+
+/* same as `pquv_set_timeouts` for the open connections and the ones opened
+ * later */
+void pquv_pool_set_timeouts(pquv_pool_t* pool, int queueTimeoutMs, int execTimeoutMs);
+
+/* same as `pquv_cancel`, on whichever connection got the request */
+void pquv_pool_cancel(pquv_pool_t* pool, void* opaque);
+
+static inline int pquv_pool_query(
+        pquv_pool_t* pool,
+        const char* q,
+        req_cb cb, void* opaque)
+{
+    return pquv_pool_query_params(pool, q, 0, NULL, NULL, NULL, NULL, cb, opaque, 0);
+}